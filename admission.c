@@ -0,0 +1,306 @@
+/*
+ * admission.c - per address and per subnet connection limits
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+
+#define RULE_ALLOW 1
+#define RULE_DENY 2
+#define RULE_LIMIT 4
+
+/* Lines of the rules file longer than this are cut. */
+#define RULE_MAX 128
+
+/* A node of the trie is a prefix: the first length bits of key, the others are 0. The trie is
+ * compressed, a node branching on the bit after its prefix, so its children can be any longer
+ * prefix. A node is there either for a rule, for a count of connections or to have two children;
+ * the ones left with none of those are removed by prune(). */
+struct AdmissionNode {
+	unsigned char key[16];
+	int length;
+	struct AdmissionNode *child[2];
+	int rules;
+	int limit;
+	int count;
+};
+
+static struct AdmissionNode *root;
+static int addressLimit;
+static int subnetLimit;
+
+/* The key each connection was counted with, by file descriptor. */
+struct Admitted {
+	unsigned char key[16];
+	int counted;
+};
+static struct Admitted *admitted;
+static int numAdmitted;
+
+static int bit(unsigned char *key, int i) {
+	return (key[i / 8] >> (7 - i % 8)) & 1;
+}
+
+/* How many leading bits, up to max, a and b have in common. */
+static int commonPrefix(unsigned char *a, unsigned char *b, int max) {
+	int i = 0;
+	while (i < max && a[i / 8] == b[i / 8]) {
+		i += 8;
+	}
+	while (i < max && bit(a, i) == bit(b, i)) {
+		i++;
+	}
+	return i < max ? i : max;
+}
+
+static int matches(struct AdmissionNode *node, unsigned char *key) {
+	return commonPrefix(node->key, key, node->length) == node->length;
+}
+
+/* The node to follow from node towards key, NULL at the end of the path. */
+static struct AdmissionNode *towards(struct AdmissionNode *node, unsigned char *key) {
+	return node->length < 128 ? node->child[bit(key, node->length)] : NULL;
+}
+
+/* IPv4 addresses are mapped to IPv6 ones, so that both are in the same trie. */
+static const unsigned char mappedPrefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+static void mapIPv4(unsigned char *key, struct in_addr *ipv4) {
+	memcpy(key, mappedPrefix, sizeof(mappedPrefix));
+	memcpy(key + sizeof(mappedPrefix), ipv4, 4);
+}
+
+static int isMapped(unsigned char *key) {
+	return memcmp(key, mappedPrefix, sizeof(mappedPrefix)) == 0;
+}
+
+static int subnetLength(unsigned char *key) {
+	return isMapped(key) ? 96 + 24 : 64;
+}
+
+/* Whether the connections from key are counted at node, and the limit of the count. 0 is no limit. */
+static int isCounted(struct AdmissionNode *node, int subnet) {
+	return (node->rules & RULE_LIMIT) || node->length == 128 || node->length == subnet;
+}
+
+static int limitOf(struct AdmissionNode *node, int subnet) {
+	if (node->rules & RULE_LIMIT) {
+		return node->limit;
+	}
+	return node->length == 128 ? addressLimit : node->length == subnet ? subnetLimit : 0;
+}
+
+static struct AdmissionNode *createNode(unsigned char *key, int length) {
+	struct AdmissionNode *node = calloc(1, sizeof(*node));
+	memcpy(node->key, key, length / 8);
+	if (length % 8 != 0) {
+		node->key[length / 8] = key[length / 8] & (0xff00 >> (length % 8));
+	}
+	node->length = length;
+	return node;
+}
+
+/* Return the node of a prefix, added if missing. */
+static struct AdmissionNode *insert(unsigned char *key, int length) {
+	struct AdmissionNode **link = &root;
+	while (*link != NULL) {
+		struct AdmissionNode *node = *link;
+		int common = commonPrefix(node->key, key, node->length < length ? node->length : length);
+		if (common == node->length && common == length) {
+			return node;
+		}
+		if (common == node->length) {
+			link = &node->child[bit(key, common)];
+			continue;
+		}
+		/* The prefix splits the one of node: the two go under their common part. */
+		struct AdmissionNode *parent = createNode(key, common);
+		parent->child[bit(node->key, common)] = node;
+		*link = parent;
+		if (common == length) {
+			return parent;
+		}
+		link = &parent->child[bit(key, common)];
+	}
+	*link = createNode(key, length);
+	return *link;
+}
+
+/* Remove the nodes on the path to key that are no longer needed. */
+static void prune(struct AdmissionNode **link, unsigned char *key) {
+	struct AdmissionNode *node = *link;
+	if (node == NULL || !matches(node, key)) {
+		return;
+	}
+	if (node->length < 128) {
+		prune(&node->child[bit(key, node->length)], key);
+	}
+	if (node->rules == 0 && node->count == 0 && (node->child[0] == NULL || node->child[1] == NULL)) {
+		*link = node->child[0] != NULL ? node->child[0] : node->child[1];
+		free(node);
+	}
+}
+
+static void count(unsigned char *key, int delta) {
+	int subnet = subnetLength(key);
+	for (struct AdmissionNode *node = root; node != NULL && matches(node, key); node = towards(node, key)) {
+		if (isCounted(node, subnet)) {
+			node->count += delta;
+		}
+	}
+}
+
+/* Parse an address with an optional /length into a key. Return the length of the prefix, -1 if invalid. */
+static int parsePrefix(char *text, unsigned char *key) {
+	char *slash = strchr(text, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+	}
+	int length, max;
+	struct in_addr ipv4;
+	if (inet_pton(AF_INET, text, &ipv4) == 1) {
+		mapIPv4(key, &ipv4);
+		max = 32;
+	} else if (inet_pton(AF_INET6, text, key) == 1) {
+		max = 128;
+	} else {
+		return -1;
+	}
+	length = max;
+	if (slash != NULL) {
+		char *end;
+		length = strtol(slash + 1, &end, 10);
+		if (end == slash + 1 || *end != '\0' || length < 0 || length > max) {
+			return -1;
+		}
+	}
+	return length + 128 - max;
+}
+
+/* Limit the connections from the same address and from the same subnet, 0 for no limit. */
+void admissionSetLimits(int perAddress, int perSubnet) {
+	addressLimit = perAddress;
+	subnetLimit = perSubnet;
+}
+
+/* Add the rules of a file, one per line: "allow prefix", "deny prefix" or "limit prefix connections",
+ * where a prefix is an IPv4 or IPv6 address, optionally followed by /length. Empty lines and lines
+ * starting with '#' are skipped. Return -1 if the file can't be read or a rule is invalid. */
+int admissionLoad(char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return -1;
+	}
+	char line[RULE_MAX + 2];
+	int result = 0;
+	while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#') {
+			continue;
+		}
+		char action[8], prefix[64];
+		int limit = 0;
+		unsigned char key[16];
+		int length;
+		int fields = sscanf(line, "%7s %63s %d", action, prefix, &limit);
+		if (fields < 2 || (length = parsePrefix(prefix, key)) == -1) {
+			result = -1;
+		} else if (strcmp(action, "allow") == 0 && fields == 2) {
+			insert(key, length)->rules |= RULE_ALLOW;
+		} else if (strcmp(action, "deny") == 0 && fields == 2) {
+			insert(key, length)->rules |= RULE_DENY;
+		} else if (strcmp(action, "limit") == 0 && fields == 3 && limit > 0) {
+			struct AdmissionNode *node = insert(key, length);
+			node->rules |= RULE_LIMIT;
+			node->limit = limit;
+		} else {
+			result = -1;
+		}
+		if (result == -1) {
+			errno = EINVAL;
+		}
+	}
+	if (ferror(file)) {
+		result = -1;
+	}
+	fclose(file);
+	return result;
+}
+
+/* Whether the connection fd from address is admitted. If so it is counted until admissionRelease(fd).
+ * Walking the path to the address visits every prefix containing it, longest last: the last rule
+ * allowing or denying decides, otherwise the connection is admitted if no count is at its limit. */
+int admissionCheck(int fd, struct sockaddr *address) {
+	unsigned char key[16];
+	if (address->sa_family == AF_INET) {
+		mapIPv4(key, &((struct sockaddr_in *) address)->sin_addr);
+	} else if (address->sa_family == AF_INET6) {
+		memcpy(key, &((struct sockaddr_in6 *) address)->sin6_addr, 16);
+	} else {
+		return 1;
+	}
+
+	/* The counts of the address and of its subnet are in nodes of their own. */
+	int subnet = subnetLength(key);
+	insert(key, subnet);
+	insert(key, 128);
+	int decision = 0;
+	int full = 0;
+	for (struct AdmissionNode *node = root; node != NULL && matches(node, key); node = towards(node, key)) {
+		if (node->rules & (RULE_ALLOW | RULE_DENY)) {
+			decision = node->rules & (RULE_ALLOW | RULE_DENY);
+		}
+		int limit = limitOf(node, subnet);
+		if (limit > 0 && node->count >= limit) {
+			full = 1;
+		}
+	}
+	if (decision == RULE_DENY || (decision != RULE_ALLOW && full)) {
+		prune(&root, key);
+		return 0;
+	}
+
+	count(key, 1);
+	if (fd >= numAdmitted) {
+		int capacity = numAdmitted == 0 ? 64 : numAdmitted;
+		while (capacity <= fd) {
+			capacity *= 2;
+		}
+		admitted = realloc(admitted, capacity * sizeof(*admitted));
+		memset(admitted + numAdmitted, 0, (capacity - numAdmitted) * sizeof(*admitted));
+		numAdmitted = capacity;
+	}
+	memcpy(admitted[fd].key, key, sizeof(key));
+	admitted[fd].counted = 1;
+	return 1;
+}
+
+/* Stop counting the connection fd, when it is closed. */
+void admissionRelease(int fd) {
+	if (fd < 0 || fd >= numAdmitted || !admitted[fd].counted) {
+		return;
+	}
+	admitted[fd].counted = 0;
+	count(admitted[fd].key, -1);
+	prune(&root, admitted[fd].key);
+}
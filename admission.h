@@ -0,0 +1,16 @@
+/* Admission control: whether a new connection is accepted, decided by the address of the peer before
+ * anything is allocated for it. Connections are counted per address and per subnet (a /24 for IPv4,
+ * a /64 for IPv6) against default limits, and per any prefix given a limit by the rules. Rules can
+ * also deny a prefix, or allow it regardless of the limits; the longest prefix matching wins.
+ * Everything is kept in a radix trie of 128-bit addresses, IPv4 ones mapped to IPv6 (::ffff:a.b.c.d),
+ * holding only the rules and the prefixes with open connections. */
+
+#include <sys/socket.h>
+
+void admissionSetLimits(int perAddress, int perSubnet);
+
+int admissionLoad(char *path);
+
+int admissionCheck(int fd, struct sockaddr *address);
+
+void admissionRelease(int fd);
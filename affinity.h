@@ -0,0 +1,5 @@
+/* Placement of the server on the machine: the CPU it runs on and the NUMA node its memory comes from. */
+
+int pinToCPU(int cpu);
+
+int nodeOfCPU(int cpu);
@@ -0,0 +1,124 @@
+/*
+ * capture.c - recording of the traffic received by the server
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+/* Records are written through a large stdio buffer: the server doesn't pay a write() per read(). */
+#define CAPTURE_BUFFER_SIZE (1024 * 1024)
+
+/* Time of the last record written, to store the delta of the next one. */
+static struct timespec lastRecord;
+
+static void writeVarint(FILE *capture, unsigned long value) {
+	while (value >= 0x80) {
+		putc((value & 0x7f) | 0x80, capture);
+		value >>= 7;
+	}
+	putc(value, capture);
+}
+
+static int readVarint(FILE *capture, unsigned long *value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = getc(capture);
+		if (byte == EOF) {
+			return -1;
+		}
+		*value |= (unsigned long) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Create a capture file, overwriting it if it exists. Return NULL on failure. */
+FILE *captureCreate(char *path) {
+	FILE *capture = fopen(path, "wb");
+	if (capture == NULL) {
+		return NULL;
+	}
+	setvbuf(capture, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+	fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture);
+	clock_gettime(CLOCK_MONOTONIC, &lastRecord);
+	return capture;
+}
+
+/* Append a record, timestamped now. */
+void captureWrite(FILE *capture, int type, unsigned long connection, char *data, unsigned long length) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long delta = (now.tv_sec - lastRecord.tv_sec) * 1000000 + (now.tv_nsec - lastRecord.tv_nsec) / 1000;
+	/* Keep the rounding error in lastRecord, so it doesn't accumulate over many records. */
+	lastRecord.tv_nsec += (delta % 1000000) * 1000;
+	lastRecord.tv_sec += delta / 1000000 + lastRecord.tv_nsec / 1000000000;
+	lastRecord.tv_nsec %= 1000000000;
+
+	putc(type, capture);
+	writeVarint(capture, delta);
+	writeVarint(capture, connection);
+	if (type == CAPTURE_DATA) {
+		writeVarint(capture, length);
+		fwrite(data, 1, length, capture);
+	}
+}
+
+/* Open a capture for reading. Return NULL if it can't be opened or it's not a capture. */
+FILE *captureOpen(char *path) {
+	FILE *capture = fopen(path, "rb");
+	if (capture == NULL) {
+		return NULL;
+	}
+	char magic[sizeof(CAPTURE_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), capture) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0) {
+		fclose(capture);
+		return NULL;
+	}
+	return capture;
+}
+
+/* Read the next record. The data, if any, is allocated and owned by the caller.
+ * Return 0 on success and -1 at the end of the capture or if it's truncated. */
+int captureRead(FILE *capture, struct CaptureRecord *record) {
+	int type = getc(capture);
+	if (type == EOF) {
+		return -1;
+	}
+	record->type = type;
+	record->length = 0;
+	record->data = NULL;
+	if (readVarint(capture, &record->delta) == -1 || readVarint(capture, &record->connection) == -1) {
+		return -1;
+	}
+	if (type == CAPTURE_DATA) {
+		if (readVarint(capture, &record->length) == -1) {
+			return -1;
+		}
+		record->data = malloc(record->length);
+		if (fread(record->data, 1, record->length, capture) != record->length) {
+			free(record->data);
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,32 @@
+/* Traffic captures: everything the clients send to the server, with timestamps.
+ * A capture starts with CAPTURE_MAGIC followed by records made of:
+ * 1. the record type (one byte)
+ * 2. the microseconds since the previous record
+ * 3. the connection, that is the file descriptor on the server while the connection is open
+ * 4. for CAPTURE_DATA records, the length of the data followed by the data itself
+ * Numbers are stored as varints: 7 bits per byte, least significant first, the highest bit
+ * set when more bytes follow. */
+
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "HRMCAP01"
+
+#define CAPTURE_CONNECT 1
+#define CAPTURE_DATA 2
+#define CAPTURE_CLOSE 3
+
+struct CaptureRecord {
+	int type;
+	unsigned long delta;
+	unsigned long connection;
+	unsigned long length;
+	char *data;
+};
+
+FILE *captureCreate(char *path);
+
+void captureWrite(FILE *capture, int type, unsigned long connection, char *data, unsigned long length);
+
+FILE *captureOpen(char *path);
+
+int captureRead(FILE *capture, struct CaptureRecord *record);
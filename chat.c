@@ -0,0 +1,438 @@
+/*
+ * chat.c - clients, channels and sessions of the chat
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chat.h"
+#include "probes.h"
+
+struct Client* connected[MAX_CLIENTS + 1];
+unsigned char outputPending[MAX_CLIENTS + 1];
+struct ClientBucket *clientHashtable[MAX_CLIENTS];
+struct Channel* dirtyHead;
+struct Channel* activeHead;
+struct Channel* activeTail;
+struct ChannelBucket *channelHashtable[MAX_CHANNELS];
+struct SessionBucket *sessionHashtable[MAX_CLIENTS];
+struct Client* detachedHead;
+struct Client* detachedTail;
+int numDetached = 0;
+struct Client* overflowedHead;
+struct Client* readyHead;
+struct Client* readyTail;
+
+struct Pool clientPool = POOL(struct Client);
+struct Pool sessionPool = POOL(struct Session);
+struct Pool inputPool = POOL(char[INPUT_SIZE]);
+struct Pool entryPool = POOL(struct OutputEntry);
+
+/* The set of file descriptors used to check incoming data: one for the server plus one for each client */
+struct pollfd fds[MAX_CLIENTS + 1];
+
+/* The number of connected clients: it's useful to specify how many items are in the fds array in poll(). */
+int numClients = 0;
+
+/* Simple hash evaluation for a string as in section 6.6 of 'The C Programming Language' */
+int hash(char* s, int size) {
+	unsigned int hashValue;
+	for (hashValue = 0; *s != '\0'; s++) {
+		hashValue = (unsigned char) *s + 31 * hashValue;
+	}
+	return hashValue % size;
+}
+
+/* Remove a client's bucket from the hashtable collection by the key (client's username).
+ * The removal is inspired by Linus Torvalds linked list argument where we take
+ * advantage of using the undirect pointer b to avoid handling the special case
+ * for removing the head.
+ * The key is the very username the client was inserted with, see insertClient(): the default
+ * usernames of a detached session and of a new connection with the same descriptor are equal,
+ * the strings are not. */
+void deleteClientByUsername(char* username) {
+	struct ClientBucket **b = &clientHashtable[hash(username, MAX_CLIENTS)];
+	while (*b != NULL && (*b)->key != username) {
+		b = &(*b)->nextInChat;
+	}
+	if (*b != NULL) {
+		struct ClientBucket *removed = *b;
+		*b = removed->nextInChat;
+		free(removed);
+	}
+}
+
+/* Insert a pair username-client in clientHashtable.
+ * There is the same reasoning for the undirect pointer b as in deleteClientByUsername.
+ * The key is the username itself, not a copy: the client is removed before it changes. */
+void insertClient(char* username, struct Client* c) {
+	struct ClientBucket **b = &clientHashtable[hash(username, MAX_CLIENTS)];
+	while (*b != NULL) {
+		b = &(*b)->nextInChat;
+	}
+
+	struct ClientBucket* newBucket;
+	newBucket = malloc(sizeof(*newBucket));
+	newBucket->key = username;
+	newBucket->value = c;
+	newBucket->nextInChat = NULL;
+	*b = newBucket;
+}
+
+/* Insert a pair name-channel in channelHashtable.
+ * There is the same reasoning for the undirect pointer b as in deleteClientByUsername. */
+void insertChannel(char* name, struct Channel* c) {
+	struct ChannelBucket **b = &channelHashtable[hash(name, MAX_CHANNELS)];
+	while (*b != NULL) {
+		b = &(*b)->nextInChat;
+	}
+
+	struct ChannelBucket* newBucket;
+	newBucket = malloc(sizeof(*newBucket));
+	newBucket->key = strdup(name);
+	newBucket->value = c;
+	newBucket->nextInChat = NULL;
+	*b = newBucket;
+}
+
+/* Insert a pair token-client in sessionHashtable, the token itself as the key like in insertClient.
+ * There is the same reasoning for the undirect pointer b as in deleteClientByUsername. */
+void insertSession(char* token, struct Client* c) {
+	struct SessionBucket **b = &sessionHashtable[hash(token, MAX_CLIENTS)];
+	while (*b != NULL) {
+		b = &(*b)->nextInChat;
+	}
+
+	struct SessionBucket* newBucket;
+	newBucket = malloc(sizeof(*newBucket));
+	newBucket->key = token;
+	newBucket->value = c;
+	newBucket->nextInChat = NULL;
+	*b = newBucket;
+}
+
+/* Remove a session's bucket from the hashtable collection by the key (session token),
+ * as in deleteClientByUsername. */
+void deleteSessionByToken(char* token) {
+	struct SessionBucket **b = &sessionHashtable[hash(token, MAX_CLIENTS)];
+	while (*b != NULL && (*b)->key != token) {
+		b = &(*b)->nextInChat;
+	}
+	if (*b != NULL) {
+		struct SessionBucket *removed = *b;
+		*b = removed->nextInChat;
+		free(removed);
+	}
+}
+
+/* Find the client, if present, contained in the bucket whose key is token. */
+struct Client* getClientByToken(char* token) {
+	struct SessionBucket* curr = sessionHashtable[hash(token, MAX_CLIENTS)];
+	while (curr != NULL) {
+		if (strcmp(curr->key, token) == 0) {
+			return curr->value;
+		}
+		curr = curr->nextInChat;
+	}
+	return NULL;
+}
+
+/* Find the client, if present, contained in the bucket whose key is username. */
+struct Client* getClientByUsername(char* username) {
+	int hashValue = hash(username, MAX_CLIENTS);
+	struct ClientBucket* curr = clientHashtable[hashValue];
+	while (curr != NULL) {
+		if (strcmp(curr->key, username) == 0) {
+			/* Client found */
+			return curr->value;
+		} else {
+			curr = curr->nextInChat;
+		}
+	}
+	/* No client with that username has been found. */
+	return NULL;
+}
+
+/* Find the channel, if present, contained in the bucket whose key is name. */
+struct Channel* getChannelByName(char* name) {
+	int hashValue = hash(name, MAX_CHANNELS);
+	struct ChannelBucket* curr = channelHashtable[hashValue];
+	while (curr != NULL) {
+		if (strcmp(curr->key, name) == 0) {
+			/* Channel found */
+			return curr->value;
+		} else {
+			curr = curr->nextInChat;
+		}
+	}
+	/* No client with that username has been found. */
+	return NULL;
+}
+
+/* Monitor the connection of a client in the next free entry of fds. */
+void addToChat(struct Client* client, int fd) {
+	client->fdsIndex = ++numClients;
+	connected[client->fdsIndex] = client;
+	outputPending[client->fdsIndex] = 0;
+	fds[client->fdsIndex].fd = fd;
+	fds[client->fdsIndex].events = POLLIN;
+	fds[client->fdsIndex].revents = 0;
+}
+
+/* Stop monitoring the connection of a client. The client of the last entry of fds takes its
+ * entry, together with the returned events, so the entries in use stay contiguous. */
+void removeFromChat(struct Client* client) {
+	int index = client->fdsIndex;
+	if (index != numClients) {
+		fds[index] = fds[numClients];
+		connected[index] = connected[numClients];
+		outputPending[index] = outputPending[numClients];
+		connected[index]->fdsIndex = index;
+	}
+	fds[numClients].fd = -1;
+	fds[numClients].events = 0;
+	fds[numClients].revents = 0;
+	connected[numClients] = NULL;
+	outputPending[numClients] = 0;
+	numClients--;
+}
+
+/* Schedule a channel for trimHistory() at the end of the current iteration. */
+void markDirty(struct Channel* channel) {
+	if (!channel->dirty) {
+		channel->dirty = 1;
+		channel->nextDirty = dirtyHead;
+		dirtyHead = channel;
+	}
+}
+
+/* Append a channel with messages to fan out to the list of active channels, unless it's there already. */
+void markActive(struct Channel* channel) {
+	if (!channel->active) {
+		channel->active = 1;
+		channel->nextActive = NULL;
+		if (activeTail == NULL) {
+			activeHead = channel;
+		} else {
+			activeTail->nextActive = channel;
+		}
+		activeTail = channel;
+	}
+}
+
+/* Remove a client from the members of its channel, if any: the last member takes its place. */
+void removeFromChannel(struct Client* client) {
+	struct Channel* channel = client->channel;
+	if (channel == NULL) {
+		return;
+	}
+	struct Client* last = channel->members[--channel->numMembers];
+	channel->members[client->memberIndex] = last;
+	last->memberIndex = client->memberIndex;
+	client->channel = NULL;
+	/* The history may have been retained for this client. */
+	markDirty(channel);
+}
+
+/* Build a message from a printf-like format, owned by the caller (refcount 1). */
+struct Message* createMessage(char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+
+	struct Message* message = malloc(sizeof(*message) + length + 1);
+	message->refcount = 1;
+	message->seq = 0;
+	message->sender = NULL;
+	message->length = length;
+	va_start(args, format);
+	vsnprintf(message->data, length + 1, format, args);
+	va_end(args);
+	return message;
+}
+
+/* Drop a reference to a message, releasing it with the last one. */
+void releaseMessage(struct Message* message) {
+	if (message != NULL && --message->refcount == 0) {
+		free(message);
+	}
+}
+
+/* Add the client to the channel with the given name, leaving its current channel if any. */
+void joinChannel(struct Client* client, char* name) {
+	/* Create the channel if it doesn't exist. */
+	struct Channel* channel;
+	if ((channel = getChannelByName(name)) == NULL) {
+		channel = calloc(1, sizeof(*channel));
+		channel->name = strdup(name);
+		channel->lastSeq = channelStart(name);
+		channel->fannedSeq = channel->lastSeq;
+		channel->firstSeq = channel->lastSeq + 1;
+		insertChannel(name, channel);
+	}
+	if (client->channel == channel) {
+		/* Joining again the current channel, e.g. when a client restores its state after a reconnect. */
+		return;
+	}
+	removeFromChannel(client);
+
+	/* Update the channel state appending the current client.
+	 * The messages sent before joining don't need to be acknowledged. */
+	client->channel = channel;
+	client->ackedSeq = channel->lastSeq;
+	client->historySeq = 0;
+	if (channel->numMembers == channel->membersCapacity) {
+		channel->membersCapacity = channel->membersCapacity == 0 ? 16 : channel->membersCapacity * 2;
+		channel->members = realloc(channel->members, channel->membersCapacity * sizeof(*channel->members));
+	}
+	client->memberIndex = channel->numMembers;
+	channel->members[channel->numMembers++] = client;
+}
+
+/* Append a client to the list of detached clients, so the oldest are at the head. */
+void addToDetached(struct Client* client) {
+	client->detached = 1;
+	client->prevDetached = detachedTail;
+	if (detachedTail == NULL) {
+		detachedHead = client;
+	} else {
+		detachedTail->nextDetached = client;
+	}
+	detachedTail = client;
+	numDetached++;
+}
+
+/* Remove a client from the list of detached clients. */
+void removeFromDetached(struct Client* client) {
+	if (client->prevDetached == NULL) {
+		detachedHead = client->nextDetached;
+	} else {
+		client->prevDetached->nextDetached = client->nextDetached;
+	}
+	if (client->nextDetached == NULL) {
+		detachedTail = client->prevDetached;
+	} else {
+		client->nextDetached->prevDetached = client->prevDetached;
+	}
+	client->nextDetached = NULL;
+	client->prevDetached = NULL;
+	client->detached = 0;
+	numDetached--;
+}
+
+/* Release all the output queued for a client. */
+void clearOutput(struct Client* client) {
+	while (client->outputHead != NULL) {
+		struct OutputEntry* entry = client->outputHead;
+		client->outputHead = entry->next;
+		releaseMessage(entry->message);
+		poolFree(&entryPool, entry);
+	}
+	client->outputTail = NULL;
+	client->outputOffset = 0;
+	client->outputBytes = 0;
+	client->controlTail = NULL;
+	client->bypassed = 0;
+}
+
+/* Remove a client from the list of clients whose output queue overflowed. */
+void removeFromOverflowed(struct Client* client) {
+	struct Client** c = &overflowedHead;
+	while (*c != client) {
+		c = &(*c)->nextOverflowed;
+	}
+	*c = client->nextOverflowed;
+	client->overflowed = 0;
+}
+
+/* Append a client to the ready queue, unless it's there already. */
+void markReady(struct Client* client) {
+	if (!client->ready) {
+		client->ready = 1;
+		client->nextReady = NULL;
+		if (readyTail == NULL) {
+			readyHead = client;
+		} else {
+			readyTail->nextReady = client;
+		}
+		readyTail = client;
+	}
+}
+
+/* Remove a client from the ready queue. */
+void removeFromReady(struct Client* client) {
+	struct Client* prev = NULL;
+	struct Client** c = &readyHead;
+	while (*c != client) {
+		prev = *c;
+		c = &(*c)->nextReady;
+	}
+	*c = client->nextReady;
+	if (readyTail == client) {
+		readyTail = prev;
+	}
+	client->ready = 0;
+}
+
+/* A new client with an empty session. */
+struct Client* allocClient() {
+	struct Client* client = poolAlloc(&clientPool);
+	client->session = poolAlloc(&sessionPool);
+	return client;
+}
+
+/* Give the input buffer of a client back to inputPool, with whatever it holds. */
+void releaseInput(struct Client* client) {
+	poolFree(&inputPool, client->input);
+	client->input = NULL;
+	client->inputLength = 0;
+}
+
+/* Release the memory of a client, once it's in no list or hashtable. */
+void releaseClient(struct Client* client) {
+	releaseInput(client);
+	free(client->session->username);
+	free(client->session->token);
+	free(client->session->recentIds);
+	poolFree(&sessionPool, client->session);
+	poolFree(&clientPool, client);
+}
+
+/* Discard all info about a client by releasing and overwriting the related resources. */
+void freeClient(struct Client* client) {
+	PROBE2(client__free, client->detached ? -1 : fds[client->fdsIndex].fd, client->session->username);
+	if (client->overflowed) {
+		removeFromOverflowed(client);
+	}
+	if (client->ready) {
+		removeFromReady(client);
+	}
+	if (client->detached) {
+		removeFromDetached(client);
+	} else {
+		closeConnection(fds[client->fdsIndex].fd);
+		removeFromChat(client);
+	}
+	deleteClientByUsername(client->session->username);
+	deleteSessionByToken(client->session->token);
+	removeFromChannel(client);
+	clearOutput(client);
+	releaseClient(client);
+}
@@ -0,0 +1,269 @@
+/*
+ * chat.h - the state of the chat server
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHAT_H
+#define CHAT_H
+
+/* The state of the chat: clients, channels and sessions, the lists that link them and the
+ * hashtables that find them. It is kept apart from the server loop so that it can be linked
+ * on its own, e.g. by microbench.c. */
+
+#include <poll.h>
+#include <time.h>
+
+#include "pool.h"
+
+#define MAX_CLIENTS 1000
+#define MAX_CHANNELS 100
+/* The longest line accepted from a client: longer ones are split. */
+#define INPUT_SIZE 1024
+
+
+/* A message broadcast in a channel. The same copy is shared by the channel history and,
+ * later, by every output that refers to it, hence the reference count. */
+struct Message {
+	int refcount;
+	unsigned long seq;
+	/* The client that broadcast it, which doesn't receive it. It is only compared, never followed:
+	 * the client may be gone by the time the message is fanned out. */
+	struct Client* sender;
+	int length;
+	char data[];
+};
+
+/* An entry of a client output queue. */
+struct OutputEntry {
+	struct Message* message;
+	struct OutputEntry* next;
+};
+
+/* The cold part of a client: what only commands, reconnections and the periodic work look at.
+ * It is kept apart so that the loops over the clients, which read their queues and links, touch
+ * fewer cache lines. */
+struct Session {
+	char* username;
+	/* Set once the user chose its username: only those users have read cursors (see cursor.h). */
+	int named;
+	/* The token that resumes the session after a disconnection. */
+	char* token;
+	time_t detachedAt;
+	/* Hashes of the ids of the last messages sent with \msg, in a ring allocated with the first
+	 * of them: a message with an id found here is a retry, see isDuplicate(). */
+	unsigned long* recentIds;
+	int recentIdsNext;
+	/* The rates in bytes per second the socket was written and read at and the sizes asked for
+	 * its buffers (0 while the kernel defaults apply), see sizeBuffers(). */
+	unsigned long sendRate;
+	unsigned long receiveRate;
+	int sendBuffer;
+	int receiveBuffer;
+};
+
+/* For each client we keep the position in the file descriptor set, which is also its entry in
+ * the arrays of connected clients, the channel with the position in its members, and the session.
+ * An idle client holds no buffer: the input buffer comes from inputPool when there is data
+ * to read and goes back once it's consumed, the output queue is empty. */
+struct Client {
+	struct Session* session;
+	int fdsIndex;
+	struct Channel* channel;
+	int memberIndex;
+	/* Data read from the socket that doesn't make a complete line yet, NULL when there is none. */
+	char* input;
+	int inputLength;
+	/* Messages waiting to be written: the first outputOffset bytes of the head are already written.
+	 * Control messages (replies and notices) jump ahead of channel messages: they are queued up to
+	 * controlTail, see queueMessage(). The last bypassed of them overtook channel messages. */
+	struct OutputEntry* outputHead;
+	struct OutputEntry* outputTail;
+	int outputOffset;
+	int outputBytes;
+	struct OutputEntry* controlTail;
+	int bypassed;
+	/* While detached the client has no connection, hence no entry in fds, and is linked in the
+	 * list of detached clients instead. */
+	int detached;
+	struct Client* nextDetached;
+	struct Client* prevDetached;
+	/* Clients may acknowledge the messages of their channel: ackedSeq is the last one acknowledged,
+	 * every message up to it has been received. Messages up to historySeq have been sent again
+	 * from history on this connection already. */
+	int acking;
+	unsigned long ackedSeq;
+	unsigned long historySeq;
+	/* Set when the output queue overflowed, the connection is closed after the current iteration. */
+	struct Client* nextOverflowed;
+	int overflowed;
+	/* Set while the input holds complete lines not processed yet: the client waits for its turn
+	 * in the ready queue and its socket is not read meanwhile. */
+	struct Client* nextReady;
+	int ready;
+	/* Bytes written to and read from the socket since the last sizing of its buffers. */
+	unsigned long sentBytes;
+	unsigned long receivedBytes;
+};
+/* The connected clients by their entry in fds, from 1 to numClients: the loops over them scan
+ * these arrays instead of following a pointer per client. connected[i] is the client of fds[i],
+ * outputPending[i] is set once output is queued to it, until flushAll(). */
+extern struct Client* connected[MAX_CLIENTS + 1];
+extern unsigned char outputPending[MAX_CLIENTS + 1];
+/* A container from which a given client can be found: the key is actually the
+ * client's username. */
+struct ClientBucket {
+	char* key;
+	struct Client* value;
+	struct ClientBucket* nextInChat;
+};
+extern struct ClientBucket *clientHashtable[MAX_CLIENTS];
+
+/* Every message broadcast in a channel gets the next sequence number of that channel.
+ * The history keeps the messages from firstSeq to lastSeq in a ring whose capacity grows and
+ * shrinks with them: the message with sequence number seq is at history[seq % historyCapacity].
+ * A channel is dirty when its history may need trimming, see trimHistory().
+ * The messages following fannedSeq are not queued to the members yet: meanwhile the channel is
+ * active, waiting for its turn in the list of active channels, see fanOut(). */
+struct Channel {
+	char *name;
+	struct Channel *nextInChat;
+	/* The members in an array, in no particular order: a member leaving is replaced by the last. */
+	struct Client** members;
+	int numMembers;
+	int membersCapacity;
+	unsigned long lastSeq;
+	unsigned long firstSeq;
+	struct Message** history;
+	unsigned long historyCapacity;
+	int dirty;
+	struct Channel* nextDirty;
+	unsigned long fannedSeq;
+	int active;
+	int deficit;
+	struct Channel* nextActive;
+	/* Bytes broadcast since the last sizing of the socket buffers and their rate in bytes per second:
+	 * every member is expected to receive that much. */
+	unsigned long broadcastBytes;
+	unsigned long broadcastRate;
+};
+extern struct Channel* dirtyHead;
+extern struct Channel* activeHead;
+extern struct Channel* activeTail;
+
+/* A container from which a given channel can be found: the key is actually the
+ * channel's name. */
+struct ChannelBucket {
+	char* key;
+	struct Channel* value;
+	struct ChannelBucket* nextInChat;
+};
+extern struct ChannelBucket *channelHashtable[MAX_CHANNELS];
+
+/* A container from which a given client can be found: the key is actually the
+ * client's session token. */
+struct SessionBucket {
+	char* key;
+	struct Client* value;
+	struct SessionBucket* nextInChat;
+};
+extern struct SessionBucket *sessionHashtable[MAX_CLIENTS];
+
+/* Detached clients ordered by time of disconnection, so the expired ones are at the head. */
+extern struct Client* detachedHead;
+extern struct Client* detachedTail;
+extern int numDetached;
+
+/* Clients whose output queue overflowed during the current iteration. */
+extern struct Client* overflowedHead;
+
+/* Clients with input to process, in the order they get their turn. */
+extern struct Client* readyHead;
+extern struct Client* readyTail;
+
+/* Clients with their sessions, input buffers and the entries of output queues come from these pools. */
+extern struct Pool clientPool;
+extern struct Pool sessionPool;
+extern struct Pool inputPool;
+extern struct Pool entryPool;
+
+
+/* The set of file descriptors used to check incoming data: one for the server plus one for each client */
+extern struct pollfd fds[MAX_CLIENTS + 1];
+
+/* The number of connected clients: it's useful to specify how many items are in the fds array in poll(). */
+extern int numClients;
+
+/* Close the connection of a client: defined by the program linking this unit. */
+void closeConnection(int fd);
+
+/* The sequence number after which a new channel is numbered: defined by the program linking this unit. */
+unsigned long channelStart(char* name);
+
+int hash(char* s, int size);
+
+void deleteClientByUsername(char* username);
+
+void insertClient(char* username, struct Client* c);
+
+void insertChannel(char* name, struct Channel* c);
+
+void insertSession(char* token, struct Client* c);
+
+void deleteSessionByToken(char* token);
+
+struct Client* getClientByToken(char* token);
+
+struct Client* getClientByUsername(char* username);
+
+struct Channel* getChannelByName(char* name);
+
+void addToChat(struct Client* client, int fd);
+
+void removeFromChat(struct Client* client);
+
+void markDirty(struct Channel* channel);
+
+void markActive(struct Channel* channel);
+
+void removeFromChannel(struct Client* client);
+
+struct Message* createMessage(char* format, ...);
+
+void releaseMessage(struct Message* message);
+
+void joinChannel(struct Client* client, char* name);
+
+void addToDetached(struct Client* client);
+
+void removeFromDetached(struct Client* client);
+
+void clearOutput(struct Client* client);
+
+void removeFromOverflowed(struct Client* client);
+
+void markReady(struct Client* client);
+
+void removeFromReady(struct Client* client);
+
+struct Client* allocClient();
+
+void releaseInput(struct Client* client);
+
+void releaseClient(struct Client* client);
+
+void freeClient(struct Client* client);
+
+#endif
@@ -16,28 +16,204 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <arpa/inet.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/socket.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "socketlib.h"
+#include "hermes.h"
+
+/* The terminal is repainted at most once per frame, that is about 60 times per second. */
+#define FRAME_INTERVAL_MS 16
+#define SCROLLBACK_LINES 1024
+#define LINE_SIZE 1024
+#define FRAME_BUFFER_SIZE (64 * 1024)
+/* Bounds of the randomized exponential backoff between reconnection attempts. */
+#define RECONNECT_MIN_DELAY_MS 500
+#define RECONNECT_MAX_DELAY_MS 30000
+
+/* Lines received from the server are kept in a ring: head is the oldest line and the
+ * last `pending` lines are the ones not drawn yet. When more lines arrive within a frame
+ * than the ring can hold, the oldest ones are overwritten and only counted in skipped. */
+struct Scrollback {
+	char lines[SCROLLBACK_LINES][LINE_SIZE];
+	int lengths[SCROLLBACK_LINES];
+	int head;
+	int count;
+	int pending;
+	long skipped;
+};
+struct Scrollback scrollback;
+
+/* All the terminal output of a frame is built here and handed to the terminal
+ * with as few write() calls as possible. */
+struct Frame {
+	char data[FRAME_BUFFER_SIZE];
+	size_t length;
+};
+struct Frame frame;
+
+/* Set when something visible changed since the last frame was drawn. */
+int dirty = 0;
+struct timespec lastFrame;
 
 /* Set the terminal to raw mode.
  * Using raw mode we can avoid that text entered by user and text from incoming messages collide. */
 void setRawMode() {
-    struct termios newTermios;
-    tcgetattr(STDIN_FILENO, &newTermios);
-    newTermios.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &newTermios);
+	struct termios newTermios;
+	tcgetattr(STDIN_FILENO, &newTermios);
+	newTermios.c_lflag &= ~(ICANON | ECHO);
+	tcsetattr(STDIN_FILENO, TCSANOW, &newTermios);
+}
+
+/* Milliseconds elapsed from start to end. */
+long elapsedMs(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Write the whole frame buffer to the terminal and empty it. */
+void frameFlush() {
+	size_t written = 0;
+	while (written < frame.length) {
+		ssize_t n = write(STDOUT_FILENO, frame.data + written, frame.length - written);
+		if (n <= 0) {
+			break;
+		}
+		written += n;
+	}
+	frame.length = 0;
+}
+
+/* Append data to the frame buffer, flushing it first if there is no room left. */
+void frameAppend(const char *data, size_t length) {
+	while (length > 0) {
+		if (frame.length == FRAME_BUFFER_SIZE) {
+			frameFlush();
+		}
+		size_t chunk = FRAME_BUFFER_SIZE - frame.length;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy(frame.data + frame.length, data, chunk);
+		frame.length += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+/* Store a line (without its '\n') in the scrollback ring, overwriting the oldest one when full. */
+void scrollbackPush(const char *line, int length) {
+	if (length > LINE_SIZE) {
+		length = LINE_SIZE;
+	}
+	int index = (scrollback.head + scrollback.count) % SCROLLBACK_LINES;
+	if (scrollback.count == SCROLLBACK_LINES) {
+		/* The ring is full: the oldest line makes room for the new one. */
+		scrollback.head = (scrollback.head + 1) % SCROLLBACK_LINES;
+		if (scrollback.pending == SCROLLBACK_LINES) {
+			scrollback.skipped++;
+			scrollback.pending--;
+		}
+	} else {
+		scrollback.count++;
+	}
+	memcpy(scrollback.lines[index], line, length);
+	scrollback.lengths[index] = length;
+	scrollback.pending++;
+	dirty = 1;
+}
+
+/* Draw a frame: the input line is hidden, then the lines arrived since the previous frame
+ * are shown and finally the prompt with the text typed so far is displayed again.
+ * Everything is sent to the terminal at once. */
+void render(const char *input, int length) {
+	/* Move to the beginning of the line and clear it. */
+	frameAppend("\033[0G\033[K", 7);
+
+	if (scrollback.skipped > 0) {
+		char notice[64];
+		int noticeLength = snprintf(notice, sizeof notice, "[%ld lines skipped]\n", scrollback.skipped);
+		frameAppend(notice, noticeLength);
+		scrollback.skipped = 0;
+	}
+
+	int first = scrollback.count - scrollback.pending;
+	for (int i = first; i < scrollback.count; i++) {
+		int index = (scrollback.head + i) % SCROLLBACK_LINES;
+		frameAppend(scrollback.lines[index], scrollback.lengths[index]);
+		frameAppend("\n", 1);
+	}
+	scrollback.pending = 0;
+
+	frameAppend("you> ", 5);
+	frameAppend(input, length);
+	frameFlush();
+
+	clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+	dirty = 0;
 }
 
-/* In main() first we create a client socket to connect to the server, then
- * we continously listen for messages from other clients and for console input */
+/* How long poll() may sleep: forever if nothing changed, otherwise until the next frame is due. */
+int frameTimeout() {
+	if (!dirty) {
+		return -1;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long remaining = FRAME_INTERVAL_MS - elapsedMs(&lastFrame, &now);
+	return remaining > 0 ? remaining : 0;
+}
+
+/* Protocol lines the library handles, not meant for the user. Replies to commands, like
+ * \unread or \pong, are shown. */
+char *protocolLines[] = { "\\server ", "\\session ", "\\ack " };
+
+/* Show a line received from the server. Protocol lines are skipped and the sequence number
+ * in front of channel messages is hidden. */
+void onMessage(struct HermesConnection *conn, char *line, int length) {
+	(void) conn;
+	for (unsigned long i = 0; i < sizeof(protocolLines) / sizeof(protocolLines[0]); i++) {
+		if (strncmp(line, protocolLines[i], strlen(protocolLines[i])) == 0) {
+			return;
+		}
+	}
+	if (line[0] == '[') {
+		char *end = strchr(line, ']');
+		if (end != NULL && end[1] == ' ') {
+			length -= end + 2 - line;
+			line = end + 2;
+		}
+	}
+	scrollbackPush(line, length);
+}
+
+/* Set while the connection is down, to tell the user when it's back. */
+int disconnected = 0;
+
+void onConnect(struct HermesConnection *conn) {
+	(void) conn;
+	if (disconnected) {
+		char *notice = "Reconnected";
+		scrollbackPush(notice, strlen(notice));
+		disconnected = 0;
+	}
+}
+
+void onDisconnect(struct HermesConnection *conn) {
+	(void) conn;
+	if (!disconnected) {
+		char *notice = "Server disconnected, reconnecting...";
+		scrollbackPush(notice, strlen(notice));
+		disconnected = 1;
+	}
+}
+
+/* In main() first we connect to the server, then we continously listen for messages
+ * from other clients and for console input. When the connection drops the library
+ * reconnects and restores username and channel, filling the gap of missed messages. */
 int main(int argc, char **argv) {
 	if (argc < 3) {
 		printf("Please specify server ip and port\n");
@@ -46,20 +222,27 @@ int main(int argc, char **argv) {
 
 	setRawMode();
 
-	int clientFD = createClient();
 	char *ip = argv[1];
 	int port = atoi(argv[2]);
-	connectToServer(clientFD, ip, port);
+	struct HermesCallbacks callbacks = { onConnect, onMessage, onDisconnect };
+	struct HermesLoop *loop = hermesCreateLoop();
+	struct HermesConnection *conn;
+	if (loop == NULL || (conn = hermesConnect(loop, ip, port, &callbacks, NULL)) == NULL) {
+		perror("Connection failed");
+		exit(EXIT_FAILURE);
+	}
+	hermesSetReconnect(conn, RECONNECT_MIN_DELAY_MS, RECONNECT_MAX_DELAY_MS);
+	hermesSetAcknowledge(conn, 1);
 
-	char buffer[1024];
+	char buffer[4096];
 	int stdinFD = fileno(stdin);
 
 	/* The set of file descriptors used to check incoming data is made up of:
-	 * 1. the client file descriptor for data from the server, that is messages from other clients
+	 * 1. the connection loop, ready when there are messages from other clients
 	 * 2. the input console where the user types the message */
 	struct pollfd fds[2];
 	int nfds = 2;
-	fds[0].fd = clientFD;
+	fds[0].fd = hermesLoopFD(loop);
 	fds[0].events = POLLIN;
 	fds[1].fd = stdinFD;
 	fds[1].events = POLLIN;
@@ -68,64 +251,59 @@ int main(int argc, char **argv) {
 	char input[1024] = {0};
 	int length = 0;
 
-	printf("you> ");
-	fflush(stdout);
+	render(input, length);
 
-	int timeout = 10000;
 	while (1) {
-		/* We wait for events */
+		/* We wait for events, waking up in time to draw the next frame if something changed
+		 * or to attempt a reconnection. */
+		int timeout = frameTimeout();
+		int reconnectTimeout = hermesTimeout(loop);
+		if (reconnectTimeout != -1 && (timeout == -1 || reconnectTimeout < timeout)) {
+			timeout = reconnectTimeout;
+		}
 		int numEvents = poll(fds, nfds, timeout);
-		if (numEvents > 0) {
-			/* When a user types on console we buffer the entered text.
-			 * If a character is the new line '\n' we send all the
-			 * the buffered data to the server, then we empty the input buffer. */
-			if (fds[1].revents & POLLIN) {
-				memset(buffer, 0, sizeof buffer);
-				int bytesRead = read(stdinFD, buffer, sizeof(buffer));
-
-				for (int i = 0; i < bytesRead; i++) {
-					printf("%c", buffer[i]);
-					fflush(stdout);
+
+		/* When a user types on console we buffer the entered text.
+		 * If a character is the new line '\n' we send all the
+		 * the buffered data to the server, then we empty the input buffer.
+		 * The typed text is displayed by the next frame. */
+		if (numEvents > 0 && (fds[1].revents & POLLIN)) {
+			int bytesRead = read(stdinFD, buffer, sizeof(buffer));
+
+			for (int i = 0; i < bytesRead; i++) {
+				dirty = 1;
+				/* Keep room for the final '\n' and the string terminator. */
+				if (length < (int) sizeof(input) - 2 || buffer[i] == '\n') {
 					input[length++] = buffer[i];
+				}
 
-					if (buffer[i] == '\n') {
-						send(clientFD, input, strlen(input), 0);
-						if (strcmp(input, "\\exit\n") == 0) {
-							printf("Bye bye\n");
-							return 0;
-						}
-						memset(input, 0, sizeof input);
-						length = 0;
-						printf("you> ");
-						fflush(stdout);
+				if (buffer[i] == '\n') {
+					hermesCommand(conn, "%s", input);
+					/* The sent text stays on screen as a line of its own. */
+					char line[LINE_SIZE];
+					int lineLength = snprintf(line, sizeof line, "you> %.*s", length - 1, input);
+					scrollbackPush(line, lineLength < LINE_SIZE ? lineLength : LINE_SIZE - 1);
+					if (strcmp(input, "\\exit\n") == 0) {
+						/* Write the command before leaving. */
+						hermesRunOnce(loop, 0);
+						render("", 0);
+						printf("Bye bye\n");
+						return 0;
 					}
+					memset(input, 0, sizeof input);
+					length = 0;
 				}
-
 			}
+		}
 
-			/* If there is a message from the server, in order to display it:
-			 * 1. we hide the text entered in input by the user
-			 * 2. we show the message on the current line
-			 * 3. we re-display the input text on the next line
-			 * Note that when the text typed by the user is on multiple lines and it receives a message, only the last line is hidden. */
-			if (fds[0].revents & POLLIN) {
-				memset(buffer, 0, sizeof buffer);
-				int bytesRead = read(clientFD, buffer, sizeof(buffer));
-
-				if (bytesRead <= 0) {
-					printf("Server disconnected. Bye bye\n");
-					return 0;
-				}
-
-                		/* Move to the beginning of the line */
-                		printf("\033[0G");
-                		/* Clear the line */
-                		printf("\033[K");
+		/* Messages from the server are stored in the scrollback ring by onMessage().
+		 * Nothing is drawn here: the next frame will show all the lines received in
+		 * the meantime at once. */
+		hermesRunOnce(loop, 0);
 
-				printf("%s", buffer);
-				printf("you> %s", input);
-				fflush(stdout);
-			}
+		/* Draw the frame if it is due. */
+		if (dirty && frameTimeout() == 0) {
+			render(input, length);
 		}
 	}
 
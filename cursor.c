@@ -0,0 +1,379 @@
+/*
+ * cursor.c - read cursors of the users in the channels
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cursor.h"
+
+/* The journal is written through a stdio buffer and flushed once per iteration of the server. */
+#define JOURNAL_BUFFER_SIZE (64 * 1024)
+/* The journal is compacted once it is this many times larger than when it was last compacted,
+ * and larger than its buffer. */
+#define JOURNAL_COMPACT_FACTOR 4
+
+/* The names of a kind, by id, and an open addressing table from the names to their ids.
+ * A slot of the table holds an id plus one, 0 when empty. */
+struct Names {
+	char **names;
+	int count;
+	int capacity;
+	int *table;
+	int tableSize;
+};
+
+/* A cursor, in a slot of the table: slots with seq 0 are empty. A cursor is dirty when it moved
+ * since its last record in the journal. */
+struct Cursor {
+	int user;
+	int channel;
+	unsigned long seq;
+	int dirty;
+};
+
+/* A dirty cursor, by its key: slots change when the table grows. */
+struct DirtyCursor {
+	int user;
+	int channel;
+};
+
+/* The channels a user has a cursor in, so that its cursors are listed without scanning the table. */
+struct UserChannels {
+	int *channels;
+	int count;
+	int capacity;
+};
+
+static struct Names names[2];
+/* The highest cursor of every channel, by channel id. */
+static unsigned long *channelLast;
+/* The channels of every user, by user id. */
+static struct UserChannels *userChannels;
+static struct Cursor *cursors;
+static int cursorsBits;
+static int numCursors;
+static struct DirtyCursor *dirtyCursors;
+static int numDirty;
+static int dirtyCapacity;
+static FILE *journal;
+static char *journalPath;
+/* The size of the journal right after it was last compacted. */
+static long journalCompacted;
+
+static void writeVarint(FILE *file, unsigned long value) {
+	while (value >= 0x80) {
+		putc((value & 0x7f) | 0x80, file);
+		value >>= 7;
+	}
+	putc(value, file);
+}
+
+static int readVarint(FILE *file, unsigned long *value) {
+	*value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = getc(file);
+		if (byte == EOF) {
+			return -1;
+		}
+		*value |= (unsigned long) (byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static unsigned long hashName(char *name) {
+	unsigned long h = 14695981039346656037UL;
+	for (char *c = name; *c != '\0'; c++) {
+		h = (h ^ (unsigned char) *c) * 1099511628211UL;
+	}
+	return h;
+}
+
+/* The slot of the table where a name is, or would be inserted. */
+static int nameSlot(struct Names *n, char *name) {
+	int slot = hashName(name) & (n->tableSize - 1);
+	while (n->table[slot] != 0 && strcmp(n->names[n->table[slot] - 1], name) != 0) {
+		slot = (slot + 1) & (n->tableSize - 1);
+	}
+	return slot;
+}
+
+/* The id of a name of the given kind, -1 if it has none. */
+int cursorFind(int kind, char *name) {
+	struct Names *n = &names[kind];
+	if (n->tableSize == 0) {
+		return -1;
+	}
+	return n->table[nameSlot(n, name)] - 1;
+}
+
+static void writeCursor(FILE *file, struct Cursor *cursor) {
+	putc(CURSOR_SET, file);
+	writeVarint(file, cursor->user);
+	writeVarint(file, cursor->channel);
+	writeVarint(file, cursor->seq);
+}
+
+static void writeName(FILE *file, int kind, int id, char *name) {
+	unsigned long length = strlen(name);
+	putc(CURSOR_NAME, file);
+	writeVarint(file, kind);
+	writeVarint(file, id);
+	writeVarint(file, length);
+	fwrite(name, 1, length, file);
+}
+
+/* The id of a name of the given kind, given to it now if it has none. */
+int cursorId(int kind, char *name) {
+	struct Names *n = &names[kind];
+	int id = cursorFind(kind, name);
+	if (id != -1) {
+		return id;
+	}
+
+	/* The table is kept at most half full. */
+	if (2 * (n->count + 1) > n->tableSize) {
+		free(n->table);
+		n->tableSize = n->tableSize == 0 ? 64 : n->tableSize * 2;
+		n->table = calloc(n->tableSize, sizeof(*n->table));
+		for (int i = 0; i < n->count; i++) {
+			n->table[nameSlot(n, n->names[i])] = i + 1;
+		}
+	}
+	if (n->count == n->capacity) {
+		n->capacity = n->capacity == 0 ? 64 : n->capacity * 2;
+		n->names = realloc(n->names, n->capacity * sizeof(*n->names));
+		if (kind == CURSOR_CHANNEL) {
+			channelLast = realloc(channelLast, n->capacity * sizeof(*channelLast));
+		} else {
+			userChannels = realloc(userChannels, n->capacity * sizeof(*userChannels));
+		}
+	}
+	id = n->count++;
+	n->names[id] = strdup(name);
+	n->table[nameSlot(n, name)] = id + 1;
+	if (kind == CURSOR_CHANNEL) {
+		channelLast[id] = 0;
+	} else {
+		memset(&userChannels[id], 0, sizeof(userChannels[id]));
+	}
+	if (journal != NULL) {
+		writeName(journal, kind, id, name);
+	}
+	return id;
+}
+
+char *cursorName(int kind, int id) {
+	return names[kind].names[id];
+}
+
+/* The slot of the table where the cursor of a user in a channel is, or would be inserted. */
+static int cursorSlot(int user, int channel) {
+	unsigned long key = (unsigned long) user << 32 | (unsigned) channel;
+	int mask = (1 << cursorsBits) - 1;
+	int slot = (key * 0x9e3779b97f4a7c15UL) >> (64 - cursorsBits);
+	while (cursors[slot].seq != 0 && (cursors[slot].user != user || cursors[slot].channel != channel)) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+/* The sequence number of the last message of a channel delivered to a user, 0 if none. */
+unsigned long cursorGet(int user, int channel) {
+	if (cursors == NULL) {
+		return 0;
+	}
+	return cursors[cursorSlot(user, channel)].seq;
+}
+
+/* Move the cursor of a user in a channel forward to seq. Cursors never move back. */
+void cursorSet(int user, int channel, unsigned long seq) {
+	/* The table is kept at most 3/4 full. */
+	if (4 * (numCursors + 1) > 3 << cursorsBits) {
+		struct Cursor *old = cursors;
+		int oldSize = cursors == NULL ? 0 : 1 << cursorsBits;
+		cursorsBits = cursors == NULL ? 8 : cursorsBits + 1;
+		cursors = calloc(1 << cursorsBits, sizeof(*cursors));
+		for (int i = 0; i < oldSize; i++) {
+			if (old[i].seq != 0) {
+				cursors[cursorSlot(old[i].user, old[i].channel)] = old[i];
+			}
+		}
+		free(old);
+	}
+	struct Cursor *cursor = &cursors[cursorSlot(user, channel)];
+	if (seq <= cursor->seq) {
+		return;
+	}
+	if (cursor->seq == 0) {
+		cursor->user = user;
+		cursor->channel = channel;
+		numCursors++;
+		struct UserChannels *u = &userChannels[user];
+		if (u->count == u->capacity) {
+			u->capacity = u->capacity == 0 ? 4 : u->capacity * 2;
+			u->channels = realloc(u->channels, u->capacity * sizeof(*u->channels));
+		}
+		u->channels[u->count++] = channel;
+	}
+	cursor->seq = seq;
+	if (seq > channelLast[channel]) {
+		channelLast[channel] = seq;
+	}
+	/* The record is written by cursorFlush(), once however many times the cursor moves meanwhile. */
+	if (journal != NULL && !cursor->dirty) {
+		cursor->dirty = 1;
+		if (numDirty == dirtyCapacity) {
+			dirtyCapacity = dirtyCapacity == 0 ? 64 : dirtyCapacity * 2;
+			dirtyCursors = realloc(dirtyCursors, dirtyCapacity * sizeof(*dirtyCursors));
+		}
+		dirtyCursors[numDirty].user = user;
+		dirtyCursors[numDirty++].channel = channel;
+	}
+}
+
+/* The highest cursor in a channel: after a restart the channel is numbered from there,
+ * so the cursors still count the messages that follow. */
+unsigned long cursorLast(int channel) {
+	return channelLast[channel];
+}
+
+/* Fill channels and seqs with the cursors of a user, max at most. Return how many. */
+int cursorList(int user, int *channels, unsigned long *seqs, int max) {
+	struct UserChannels *u = &userChannels[user];
+	int found = 0;
+	for (int i = 0; i < u->count && found < max; i++) {
+		channels[found] = u->channels[i];
+		seqs[found++] = cursorGet(user, u->channels[i]);
+	}
+	return found;
+}
+
+/* Load the cursors of a journal, stopping at the first record truncated or out of place. */
+static void load(FILE *file) {
+	char magic[sizeof(CURSOR_MAGIC) - 1];
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, CURSOR_MAGIC, sizeof(magic)) != 0) {
+		return;
+	}
+	int type;
+	while ((type = getc(file)) != EOF) {
+		unsigned long a, b, c;
+		if (readVarint(file, &a) == -1 || readVarint(file, &b) == -1 || readVarint(file, &c) == -1) {
+			return;
+		}
+		if (type == CURSOR_NAME) {
+			if (a > CURSOR_CHANNEL || b != (unsigned long) names[a].count || c >= 4096) {
+				return;
+			}
+			char name[4096];
+			if (fread(name, 1, c, file) != c) {
+				return;
+			}
+			name[c] = '\0';
+			cursorId(a, name);
+		} else if (type == CURSOR_SET && a < (unsigned long) names[CURSOR_USER].count
+				&& b < (unsigned long) names[CURSOR_CHANNEL].count) {
+			cursorSet(a, b, c);
+		} else {
+			return;
+		}
+	}
+}
+
+/* Write the journal again, with just the names and the last value of every cursor, in place of the
+ * one at journalPath, and keep appending to the new one. Return -1 if it can't be written: the
+ * current journal, if any, is kept then. */
+static int compact() {
+	int length = strlen(journalPath) + 5;
+	char *temporary = malloc(length);
+	snprintf(temporary, length, "%s.tmp", journalPath);
+	FILE *file = fopen(temporary, "wb");
+	if (file == NULL) {
+		free(temporary);
+		return -1;
+	}
+	setvbuf(file, NULL, _IOFBF, JOURNAL_BUFFER_SIZE);
+	fwrite(CURSOR_MAGIC, 1, strlen(CURSOR_MAGIC), file);
+	for (int kind = CURSOR_USER; kind <= CURSOR_CHANNEL; kind++) {
+		for (int id = 0; id < names[kind].count; id++) {
+			writeName(file, kind, id, names[kind].names[id]);
+		}
+	}
+	for (int i = 0; cursors != NULL && i < 1 << cursorsBits; i++) {
+		if (cursors[i].seq != 0) {
+			writeCursor(file, &cursors[i]);
+			cursors[i].dirty = 0;
+		}
+	}
+	if (fflush(file) != 0 || rename(temporary, journalPath) == -1) {
+		fclose(file);
+		free(temporary);
+		return -1;
+	}
+	free(temporary);
+	if (journal != NULL) {
+		fclose(journal);
+	}
+	journal = file;
+	journalCompacted = ftell(file);
+	numDirty = 0;
+	return 0;
+}
+
+/* Load the journal at path, if any, and keep appending to it. On the way the journal is
+ * compacted. Return 0 on success and -1 if the journal can't be written. */
+int cursorOpen(char *path) {
+	FILE *file = fopen(path, "rb");
+	if (file != NULL) {
+		load(file);
+		fclose(file);
+	}
+	journalPath = strdup(path);
+	return compact();
+}
+
+/* Write a record for every cursor moved since the last call and flush the journal. A journal
+ * grown JOURNAL_COMPACT_FACTOR times since it was compacted is compacted again. */
+void cursorFlush() {
+	if (journal == NULL) {
+		return;
+	}
+	for (int i = 0; i < numDirty; i++) {
+		struct Cursor *cursor = &cursors[cursorSlot(dirtyCursors[i].user, dirtyCursors[i].channel)];
+		writeCursor(journal, cursor);
+		cursor->dirty = 0;
+	}
+	numDirty = 0;
+	fflush(journal);
+	long size = ftell(journal);
+	if (size > JOURNAL_BUFFER_SIZE && size > JOURNAL_COMPACT_FACTOR * journalCompacted && compact() == -1) {
+		/* Try again once it grows as much again. */
+		journalCompacted = size;
+	}
+}
+
+void cursorClose() {
+	if (journal != NULL) {
+		cursorFlush();
+		fclose(journal);
+		journal = NULL;
+	}
+}
@@ -0,0 +1,39 @@
+/* Read cursors: for every user and channel, the sequence number of the last message of the channel
+ * delivered to the user or acknowledged by it. Users and channels are known by small ids, given to
+ * their names in order of appearance, and the cursors live in an open addressing table keyed by the
+ * pair of ids. Every user also lists the channels it has a cursor in, to find its cursors quickly.
+ * The cursors may be kept in a journal, loaded back on start: a record is appended once per iteration
+ * for every cursor that changed, and the journal is written again from the table as it grows.
+ * A journal starts with CURSOR_MAGIC followed by records made of:
+ * 1. the record type (one byte)
+ * 2. for CURSOR_NAME records, the kind of name, its id, the length of the name and the name itself;
+ *    for CURSOR_SET records, the user id, the channel id and the sequence number
+ * Numbers are stored as varints, like in captures (see capture.h). */
+
+#define CURSOR_MAGIC "HRMCUR01"
+
+#define CURSOR_NAME 1
+#define CURSOR_SET 2
+
+#define CURSOR_USER 0
+#define CURSOR_CHANNEL 1
+
+int cursorOpen(char *path);
+
+void cursorFlush();
+
+void cursorClose();
+
+int cursorFind(int kind, char *name);
+
+int cursorId(int kind, char *name);
+
+char *cursorName(int kind, int id);
+
+void cursorSet(int user, int channel, unsigned long seq);
+
+unsigned long cursorGet(int user, int channel);
+
+unsigned long cursorLast(int channel);
+
+int cursorList(int user, int *channels, unsigned long *seqs, int max);
@@ -0,0 +1,231 @@
+/*
+ * filter.c - multi-pattern moderation filter
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "filter.h"
+
+/* Patterns longer than this are cut, lines of the pattern file as well. */
+#define PATTERN_MAX 256
+
+/* The automaton is a table of transitions by state and class of byte: bytes that don't appear
+ * in any pattern are all class 0, the others get a class each, shared by upper and lower case.
+ * Reaching a state with match set means a pattern ends there.
+ * While the automaton is at the initial state only a byte starting some pattern can take it
+ * elsewhere, so the scan skips to the next one: with SSSE3 16 bytes at a time, looking the two
+ * nibbles of every byte up in loNibble and hiNibble like Teddy does. Every byte starting a pattern
+ * has a bit in both entries of its nibbles, so a byte with no common bit doesn't start any;
+ * a byte with one may not either, it's just stepped through. */
+struct Filter {
+	unsigned char classOf[256];
+	int numClasses;
+	int numStates;
+	int *next;
+	unsigned char *match;
+	unsigned char first[256];
+	unsigned char loNibble[16];
+	unsigned char hiNibble[16];
+	int ssse3;
+};
+
+/* Compile the patterns, ignoring the empty ones. */
+struct Filter *filterCompile(char **patterns, int count) {
+	struct Filter *filter = calloc(1, sizeof(*filter));
+	filter->numClasses = 1;
+	int length = 0;
+	for (int p = 0; p < count; p++) {
+		for (unsigned char *b = (unsigned char *) patterns[p]; *b != '\0'; b++, length++) {
+			int lower = tolower(*b);
+			if (filter->classOf[lower] == 0) {
+				filter->classOf[lower] = filter->classOf[toupper(lower)] = filter->numClasses++;
+			}
+		}
+	}
+
+	/* The trie of the patterns first: a transition to state 0 is a missing one. */
+	int classes = filter->numClasses;
+	int capacity = length + 1;
+	filter->next = calloc((size_t) capacity * classes, sizeof(*filter->next));
+	filter->match = calloc(capacity, 1);
+	filter->numStates = 1;
+	int bucket = 0;
+	for (int p = 0; p < count; p++) {
+		unsigned char *b = (unsigned char *) patterns[p];
+		if (*b == '\0') {
+			continue;
+		}
+		if (!filter->first[*b]) {
+			/* Both cases of the first byte, in the same bucket. */
+			int bit = 1 << (bucket++ % 8);
+			int cases[2] = { tolower(*b), toupper(*b) };
+			for (int i = 0; i < 2; i++) {
+				filter->first[cases[i]] = 1;
+				filter->loNibble[cases[i] & 0x0f] |= bit;
+				filter->hiNibble[cases[i] >> 4] |= bit;
+			}
+		}
+		int state = 0;
+		for (; *b != '\0'; b++) {
+			int *transition = &filter->next[state * classes + filter->classOf[*b]];
+			if (*transition == 0) {
+				*transition = filter->numStates++;
+			}
+			state = *transition;
+		}
+		filter->match[state] = 1;
+	}
+
+	/* Then the failure links, breadth first so that the one of a state is complete before its
+	 * children need it: the missing transitions are taken from the failure link, which makes
+	 * the trie a complete automaton. */
+	int *fail = calloc(filter->numStates, sizeof(*fail));
+	int *queue = malloc(filter->numStates * sizeof(*queue));
+	int head = 0, tail = 0;
+	for (int c = 0; c < classes; c++) {
+		if (filter->next[c] != 0) {
+			queue[tail++] = filter->next[c];
+		}
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		filter->match[state] |= filter->match[fail[state]];
+		for (int c = 0; c < classes; c++) {
+			int *transition = &filter->next[state * classes + c];
+			int fallback = filter->next[fail[state] * classes + c];
+			if (*transition == 0) {
+				*transition = fallback;
+			} else {
+				fail[*transition] = fallback;
+				queue[tail++] = *transition;
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+
+#ifdef __x86_64__
+	filter->ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+	return filter;
+}
+
+/* Compile the patterns of a file, one per line. Empty lines and lines starting with '#' are skipped.
+ * Return NULL if the file can't be read. */
+struct Filter *filterLoad(char *path) {
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return NULL;
+	}
+	char **patterns = NULL;
+	int count = 0, capacity = 0;
+	char line[PATTERN_MAX + 2];
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (strchr(line, '\n') == NULL) {
+			/* The line is cut: the rest of it is not another pattern. */
+			int c;
+			while ((c = getc(file)) != EOF && c != '\n') {
+			}
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#') {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = capacity == 0 ? 64 : capacity * 2;
+			patterns = realloc(patterns, capacity * sizeof(*patterns));
+		}
+		patterns[count++] = strdup(line);
+	}
+	int error = ferror(file);
+	fclose(file);
+
+	struct Filter *filter = error ? NULL : filterCompile(patterns, count);
+	for (int i = 0; i < count; i++) {
+		free(patterns[i]);
+	}
+	free(patterns);
+	return filter;
+}
+
+#ifdef __x86_64__
+/* The position of the next byte from i on that may start a pattern, see struct Filter. */
+__attribute__((target("ssse3")))
+static int skipVector(struct Filter *filter, unsigned char *text, int i, int length) {
+	__m128i lo = _mm_loadu_si128((__m128i *) filter->loNibble);
+	__m128i hi = _mm_loadu_si128((__m128i *) filter->hiNibble);
+	__m128i nibble = _mm_set1_epi8(0x0f);
+	__m128i zero = _mm_setzero_si128();
+	for (; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((__m128i *) (text + i));
+		__m128i candidates = _mm_and_si128(
+			_mm_shuffle_epi8(lo, _mm_and_si128(block, nibble)),
+			_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(block, 4), nibble)));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(candidates, zero)) ^ 0xffff;
+		if (mask != 0) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i;
+}
+#endif
+
+static int skip(struct Filter *filter, unsigned char *text, int i, int length) {
+	for (;;) {
+#ifdef __x86_64__
+		if (filter->ssse3) {
+			i = skipVector(filter, text, i, length);
+		}
+#endif
+		/* The vectors stop at a candidate or at the last 16 bytes, the rest is byte by byte. */
+		if (i == length || filter->first[text[i]]) {
+			return i;
+		}
+		i++;
+	}
+}
+
+/* Whether the text contains any of the patterns. */
+int filterMatch(struct Filter *filter, char *text, int length) {
+	unsigned char *bytes = (unsigned char *) text;
+	int state = 0;
+	for (int i = 0; i < length; i++) {
+		if (state == 0 && (i = skip(filter, bytes, i, length)) == length) {
+			return 0;
+		}
+		state = filter->next[state * filter->numClasses + filter->classOf[bytes[i]]];
+		if (filter->match[state]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void filterFree(struct Filter *filter) {
+	if (filter != NULL) {
+		free(filter->next);
+		free(filter->match);
+		free(filter);
+	}
+}
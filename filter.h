@@ -0,0 +1,13 @@
+/* Moderation filter: tells whether a text contains any of a list of banned patterns, ignoring
+ * the case of ASCII letters. The patterns are compiled into an Aho-Corasick automaton, so a text
+ * is scanned once whatever the number of patterns. */
+
+struct Filter;
+
+struct Filter *filterCompile(char **patterns, int count);
+
+struct Filter *filterLoad(char *path);
+
+int filterMatch(struct Filter *filter, char *text, int length);
+
+void filterFree(struct Filter *filter);
@@ -0,0 +1,759 @@
+/*
+ * hermes.c - asynchronous client library for the chat server
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hermes.h"
+#include "socketlib.h"
+
+#define MAX_EVENTS 1024
+/* Bytes read from a single connection per wakeup, so that a chatty connection
+ * cannot starve the others sharing the loop. */
+#define READ_CHUNK 16384
+/* Lines longer than this are delivered in pieces. */
+#define MAX_LINE 65536
+/* Commands that cannot be queued beyond this limit are refused. */
+#define MAX_OUTPUT (1024 * 1024)
+
+#define STATE_CONNECTING 0
+#define STATE_CONNECTED 1
+#define STATE_CLOSED 2
+/* Disconnected, waiting for the next reconnection attempt. */
+#define STATE_WAITING 3
+
+struct HermesConnection {
+	int fd;
+	int state;
+	struct HermesLoop *loop;
+	struct HermesCallbacks callbacks;
+	void *userData;
+	char *ip;
+	int port;
+
+	/* Reconnection with exponential backoff: the n-th consecutive attempt waits a random
+	 * time between half and all of minDelay * 2^n milliseconds, capped at maxDelay.
+	 * A minDelay of 0 disables reconnection. */
+	int minDelay;
+	int maxDelay;
+	int attempts;
+	long retryAt;
+
+	/* The state to restore after a reconnect: the username, the channel and the sequence
+	 * number of the last message received in it. The server identifier tells whether the
+	 * server restarted in the meantime, which resets the sequence numbers. */
+	char *username;
+	char *channel;
+	unsigned long lastSeq;
+	char *serverID;
+	/* The server keeps our session for a while after a disconnection: presenting this token
+	 * on the new connection restores it without going through username and channel again. */
+	char *token;
+
+	/* Whether received messages are acknowledged to the server, and the last acknowledged. */
+	int acknowledge;
+	unsigned long ackedSeq;
+
+	/* Data received and not yet split in lines. */
+	char *input;
+	int inputLength;
+	int inputSize;
+
+	/* Queued commands: output[outputOffset..outputLength) is still to be written. */
+	char *output;
+	int outputOffset;
+	int outputLength;
+	int outputSize;
+	/* The first burstLength bytes of output are the burst of the current reconnection attempt,
+	 * until they are written: see reconnect(). */
+	int burstLength;
+
+	/* Whether the connection is in loop->flushHead and whether EPOLLOUT is being watched. */
+	int flushPending;
+	int watchingOutput;
+
+	struct HermesConnection *nextInLoop;
+	struct HermesConnection *prevInLoop;
+	struct HermesConnection *nextToFlush;
+	struct HermesConnection *nextClosed;
+	struct HermesConnection *nextWaiting;
+};
+
+struct HermesLoop {
+	int epollFD;
+	int running;
+	/* Every connection of the loop. */
+	struct HermesConnection *head;
+	/* Connections with commands queued during the current iteration: they are written
+	 * together at the end of it, so many commands cost a single write(). */
+	struct HermesConnection *flushHead;
+	/* Closed connections are released at the end of the iteration, since the events
+	 * returned by epoll_wait() may still refer to them. */
+	struct HermesConnection *closedHead;
+	/* Connections waiting to reconnect. */
+	struct HermesConnection *waitingHead;
+	/* State of the generator for the reconnection jitter. */
+	unsigned int seed;
+	/* Connections are opened with TCP Fast Open, see hermesSetFastOpen(). */
+	int fastOpen;
+	struct epoll_event events[MAX_EVENTS];
+};
+
+/* Create a loop without any connection. Return NULL on failure. */
+struct HermesLoop *hermesCreateLoop() {
+	struct HermesLoop *loop = calloc(1, sizeof(*loop));
+	if (loop == NULL) {
+		return NULL;
+	}
+	if ((loop->epollFD = epoll_create1(0)) == -1) {
+		free(loop);
+		return NULL;
+	}
+	/* Processes started together must not pick the same delays. */
+	loop->seed = time(NULL) ^ (getpid() << 16) ^ (unsigned long) loop;
+	return loop;
+}
+
+/* Open the connections of the loop with TCP Fast Open: once a server that accepts it gave a cookie,
+ * the commands queued before connecting, like the burst restoring a session, travel with the SYN and
+ * reconnecting saves a round trip. onConnect is then invoked before the handshake completes. */
+void hermesSetFastOpen(struct HermesLoop *loop, int enabled) {
+	loop->fastOpen = enabled;
+}
+
+/* The file descriptor of the epoll instance: it becomes readable when the loop has events
+ * to process, so the loop can be nested in another poll()/epoll based program that calls
+ * hermesRunOnce(loop, 0) when it's ready. */
+int hermesLoopFD(struct HermesLoop *loop) {
+	return loop->epollFD;
+}
+
+void *hermesUserData(struct HermesConnection *conn) {
+	return conn->userData;
+}
+
+/* Acknowledge the messages received, once per loop iteration. The server can then release the
+ * messages it was keeping for us, and resuming the session gives back exactly the ones missed. */
+void hermesSetAcknowledge(struct HermesConnection *conn, int enabled) {
+	conn->acknowledge = enabled;
+}
+
+/* The sequence number of the last message received in the current channel. */
+unsigned long hermesLastSeq(struct HermesConnection *conn) {
+	return conn->lastSeq;
+}
+
+/* Milliseconds of a monotonic clock. */
+static long now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Replace a saved string with a copy of value. */
+static void save(char **field, char *value, int length) {
+	free(*field);
+	*field = malloc(length + 1);
+	memcpy(*field, value, length);
+	(*field)[length] = '\0';
+}
+
+/* Update the set of events epoll watches for a connection. */
+static void watch(struct HermesConnection *conn, int operation) {
+	struct epoll_event event = {0};
+	event.data.ptr = conn;
+	if (conn->state == STATE_CONNECTING) {
+		/* A non-blocking connect() completes when the socket becomes writable. */
+		event.events = EPOLLOUT;
+	} else {
+		event.events = EPOLLIN | (conn->watchingOutput ? EPOLLOUT : 0);
+	}
+	epoll_ctl(conn->loop->epollFD, operation, conn->fd, &event);
+}
+
+/* Start connecting to the server. Commands can be issued right away: they are sent as soon as
+ * the connection is established. Return NULL if the connection cannot even be started. */
+struct HermesConnection *hermesConnect(struct HermesLoop *loop, char *ip, int port,
+		struct HermesCallbacks *callbacks, void *userData) {
+	int fd = createNonBlockingClient();
+	if (fd == -1) {
+		return NULL;
+	}
+	if (loop->fastOpen) {
+		setFastOpenConnect(fd);
+	}
+	int status = startConnection(fd, ip, port);
+	if (status == -1) {
+		close(fd);
+		return NULL;
+	}
+
+	struct HermesConnection *conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		close(fd);
+		return NULL;
+	}
+	conn->fd = fd;
+	conn->ip = strdup(ip);
+	conn->port = port;
+	conn->loop = loop;
+	conn->userData = userData;
+	if (callbacks != NULL) {
+		conn->callbacks = *callbacks;
+	}
+
+	conn->nextInLoop = loop->head;
+	if (loop->head != NULL) {
+		loop->head->prevInLoop = conn;
+	}
+	loop->head = conn;
+
+	conn->state = STATE_CONNECTING;
+	watch(conn, EPOLL_CTL_ADD);
+	return conn;
+}
+
+/* Close the connection and stop delivering its events. No callback is invoked.
+ * The memory is released by the loop, so it's safe to call it from a callback. */
+void hermesClose(struct HermesConnection *conn) {
+	if (conn->state == STATE_CLOSED) {
+		return;
+	}
+	if (conn->state == STATE_WAITING) {
+		struct HermesConnection **c = &conn->loop->waitingHead;
+		while (*c != conn) {
+			c = &(*c)->nextWaiting;
+		}
+		*c = conn->nextWaiting;
+	} else {
+		epoll_ctl(conn->loop->epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+	}
+	conn->state = STATE_CLOSED;
+	conn->nextClosed = conn->loop->closedHead;
+	conn->loop->closedHead = conn;
+}
+
+/* Enable reconnection when the connection is lost or cannot be established, waiting
+ * between minDelay and maxDelay milliseconds between attempts. A minDelay of 0 disables it. */
+void hermesSetReconnect(struct HermesConnection *conn, int minDelay, int maxDelay) {
+	conn->minDelay = minDelay;
+	conn->maxDelay = maxDelay < minDelay ? minDelay : maxDelay;
+}
+
+/* Schedule the next reconnection attempt with exponential backoff and jitter, so that
+ * the clients dropped together by a server restart don't come back all at once. */
+static void scheduleReconnect(struct HermesConnection *conn) {
+	long delay = conn->minDelay;
+	for (int i = 0; i < conn->attempts && delay < conn->maxDelay; i++) {
+		delay *= 2;
+	}
+	if (delay > conn->maxDelay) {
+		delay = conn->maxDelay;
+	}
+	delay = delay / 2 + rand_r(&conn->loop->seed) % (delay / 2 + 1);
+	conn->attempts++;
+
+	conn->retryAt = now() + delay;
+	conn->state = STATE_WAITING;
+	conn->nextWaiting = conn->loop->waitingHead;
+	conn->loop->waitingHead = conn;
+}
+
+/* The connection has been lost: notify the user and close it, or wait to reconnect. */
+static void lose(struct HermesConnection *conn) {
+	/* Failed reconnection attempts are not reported, the user already knows the connection is down. */
+	int notify = conn->state == STATE_CONNECTED || conn->minDelay == 0;
+	if (conn->minDelay == 0) {
+		hermesClose(conn);
+	} else {
+		epoll_ctl(conn->loop->epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+		conn->fd = -1;
+		conn->watchingOutput = 0;
+		conn->inputLength = 0;
+
+		/* The burst of this attempt is dropped unless it was written completely: the next
+		 * attempt puts its own in front, so it is never sent twice. */
+		if (conn->outputOffset < conn->burstLength) {
+			memmove(conn->output, conn->output + conn->burstLength, conn->outputLength - conn->burstLength);
+			conn->outputLength -= conn->burstLength;
+			conn->outputOffset = 0;
+		}
+		conn->burstLength = 0;
+
+		/* Commands not completely written are sent again after the reconnect, the ones
+		 * already written are lost with the connection. A partially written line is
+		 * sent again from its beginning. */
+		int start = conn->outputOffset;
+		while (start > 0 && conn->output[start - 1] != '\n') {
+			start--;
+		}
+		memmove(conn->output, conn->output + start, conn->outputLength - start);
+		conn->outputLength -= start;
+		conn->outputOffset = 0;
+
+		scheduleReconnect(conn);
+	}
+	if (notify && conn->callbacks.onDisconnect != NULL) {
+		conn->callbacks.onDisconnect(conn);
+	}
+}
+
+/* Unlink a closed connection from the loop and release its memory. */
+static void release(struct HermesConnection *conn) {
+	struct HermesLoop *loop = conn->loop;
+	if (conn->prevInLoop == NULL) {
+		loop->head = conn->nextInLoop;
+	} else {
+		conn->prevInLoop->nextInLoop = conn->nextInLoop;
+	}
+	if (conn->nextInLoop != NULL) {
+		conn->nextInLoop->prevInLoop = conn->prevInLoop;
+	}
+	free(conn->input);
+	free(conn->output);
+	free(conn->ip);
+	free(conn->username);
+	free(conn->channel);
+	free(conn->serverID);
+	free(conn->token);
+	free(conn);
+}
+
+/* Make sure buffer has room for at least needed bytes, doubling it as required. */
+static int reserve(char **buffer, int *size, int needed, int limit) {
+	if (needed <= *size) {
+		return 0;
+	}
+	if (needed > limit) {
+		return -1;
+	}
+	int newSize = *size == 0 ? 256 : *size;
+	while (newSize < needed) {
+		newSize *= 2;
+	}
+	if (newSize > limit) {
+		newSize = limit;
+	}
+	char *newBuffer = realloc(*buffer, newSize);
+	if (newBuffer == NULL) {
+		return -1;
+	}
+	*buffer = newBuffer;
+	*size = newSize;
+	return 0;
+}
+
+/* Write as much queued output as the socket accepts. When the kernel buffer is full
+ * we watch for EPOLLOUT to continue later. */
+static void flush(struct HermesConnection *conn) {
+	while (conn->outputOffset < conn->outputLength) {
+		ssize_t n = send(conn->fd, conn->output + conn->outputOffset,
+				conn->outputLength - conn->outputOffset, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* A Fast Open connection without a cookie: the data waits for the handshake. */
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+				break;
+			}
+			lose(conn);
+			return;
+		}
+		conn->outputOffset += n;
+	}
+
+	int pending = conn->outputOffset < conn->outputLength;
+	if (!pending) {
+		conn->outputOffset = 0;
+		conn->outputLength = 0;
+		conn->burstLength = 0;
+	}
+	if (pending != conn->watchingOutput) {
+		conn->watchingOutput = pending;
+		watch(conn, EPOLL_CTL_MOD);
+	}
+}
+
+/* Append raw bytes to the output of a connection. Return -1 if too much output is already queued. */
+static int append(struct HermesConnection *conn, char *data, int length) {
+	/* Reclaim the space of the data already written before growing the buffer. */
+	if (conn->outputOffset > 0 && conn->outputLength + length > conn->outputSize) {
+		memmove(conn->output, conn->output + conn->outputOffset, conn->outputLength - conn->outputOffset);
+		conn->outputLength -= conn->outputOffset;
+		conn->burstLength = conn->burstLength > conn->outputOffset ? conn->burstLength - conn->outputOffset : 0;
+		conn->outputOffset = 0;
+	}
+	if (reserve(&conn->output, &conn->outputSize, conn->outputLength + length, MAX_OUTPUT) == -1) {
+		return -1;
+	}
+	memcpy(conn->output + conn->outputLength, data, length);
+	conn->outputLength += length;
+	return 0;
+}
+
+/* Have the output of a connection written at the end of the current iteration. */
+static void scheduleFlush(struct HermesConnection *conn) {
+	if (!conn->flushPending) {
+		conn->flushPending = 1;
+		conn->nextToFlush = conn->loop->flushHead;
+		conn->loop->flushHead = conn;
+	}
+}
+
+/* Write the output of every connection that queued commands since the last flush.
+ * Connections acknowledging messages add a single acknowledgement for all the ones received
+ * during the iteration. */
+static void flushAll(struct HermesLoop *loop) {
+	while (loop->flushHead != NULL) {
+		struct HermesConnection *conn = loop->flushHead;
+		loop->flushHead = conn->nextToFlush;
+		conn->flushPending = 0;
+		if (conn->state != STATE_CONNECTED) {
+			continue;
+		}
+		if (conn->acknowledge && conn->ackedSeq != conn->lastSeq) {
+			char ack[32];
+			int length = snprintf(ack, sizeof(ack), "\\ack %lu\n", conn->lastSeq);
+			if (append(conn, ack, length) == 0) {
+				conn->ackedSeq = conn->lastSeq;
+			}
+		}
+		if (!conn->watchingOutput) {
+			flush(conn);
+		}
+	}
+}
+
+/* Queue raw bytes to be sent to the server. Return -1 if the connection is closed
+ * or too much output is already queued. */
+static int enqueue(struct HermesConnection *conn, char *data, int length) {
+	if (conn->state == STATE_CLOSED || append(conn, data, length) == -1) {
+		return -1;
+	}
+	scheduleFlush(conn);
+	return 0;
+}
+
+/* Queue a command built from a printf-like format. The trailing '\n' is added if missing.
+ * Commands are pipelined: nothing waits for the reply of the previous one. */
+int hermesCommand(struct HermesConnection *conn, char *format, ...) {
+	char line[1024];
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line, sizeof(line) - 1, format, args);
+	va_end(args);
+
+	if (length < 0) {
+		return -1;
+	}
+	if (length > (int) sizeof(line) - 2) {
+		length = sizeof(line) - 2;
+	}
+	if (length == 0 || line[length - 1] != '\n') {
+		line[length++] = '\n';
+	}
+
+	/* Remember the state to restore after a reconnect. */
+	if (strncmp(line, "\\setusername ", 13) == 0) {
+		save(&conn->username, line + 13, length - 14);
+	} else if (strncmp(line, "\\join ", 6) == 0) {
+		if (conn->channel == NULL || strncmp(conn->channel, line + 6, length - 7) != 0
+				|| conn->channel[length - 7] != '\0') {
+			/* Sequence numbers are per channel. */
+			conn->lastSeq = 0;
+		}
+		save(&conn->channel, line + 6, length - 7);
+	} else if (strcmp(line, "\\exit\n") == 0) {
+		/* The user is leaving on purpose. */
+		conn->minDelay = 0;
+	}
+	return enqueue(conn, line, length);
+}
+
+/* Queue a text message for the current channel. */
+int hermesSend(struct HermesConnection *conn, char *text) {
+	return hermesCommand(conn, "%s", text);
+}
+
+/* Queue a text message with an id, without spaces, chosen by the caller. Sending it again with
+ * the same id, e.g. when unsure whether it got through before a reconnect, is safe: the server
+ * broadcasts it once as long as it's among the last 64 ids of the session. */
+int hermesSendWithId(struct HermesConnection *conn, char *id, char *text) {
+	return hermesCommand(conn, "\\msg %s %s", id, text);
+}
+
+int hermesSetUsername(struct HermesConnection *conn, char *username) {
+	return hermesCommand(conn, "\\setusername %s", username);
+}
+
+int hermesJoin(struct HermesConnection *conn, char *channel) {
+	return hermesCommand(conn, "\\join %s", channel);
+}
+
+/* Complete a non-blocking connect(): on success commands queued so far are sent. */
+static void finishConnection(struct HermesConnection *conn) {
+	int error = 0;
+	socklen_t length = sizeof(error);
+	if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+		lose(conn);
+		return;
+	}
+
+	conn->state = STATE_CONNECTED;
+	conn->attempts = 0;
+	conn->watchingOutput = 0;
+	watch(conn, EPOLL_CTL_MOD);
+	if (conn->callbacks.onConnect != NULL) {
+		conn->callbacks.onConnect(conn);
+	}
+	if (conn->state == STATE_CONNECTED && conn->outputLength > 0) {
+		scheduleFlush(conn);
+	}
+}
+
+/* Attempt to reconnect. The session is resumed if the server still has it, otherwise
+ * username and channel are restored; in both cases the messages missed in the meantime
+ * are requested. All of this goes in one burst placed before the commands that were
+ * still queued: nothing waits for a reply, the commands following a successful resume
+ * find everything already in place and have no effect. */
+static void reconnect(struct HermesConnection *conn) {
+	int fd = createNonBlockingClient();
+	if (fd != -1 && conn->loop->fastOpen) {
+		setFastOpenConnect(fd);
+	}
+	if (fd == -1 || startConnection(fd, conn->ip, conn->port) == -1) {
+		if (fd != -1) {
+			close(fd);
+		}
+		scheduleReconnect(conn);
+		return;
+	}
+	conn->fd = fd;
+	conn->state = STATE_CONNECTING;
+	watch(conn, EPOLL_CTL_ADD);
+
+	char burst[1024];
+	int length = 0;
+	if (conn->token != NULL) {
+		length += snprintf(burst + length, sizeof(burst) - length, "\\resume %s\n", conn->token);
+	}
+	if (conn->username != NULL && length < (int) sizeof(burst)) {
+		length += snprintf(burst + length, sizeof(burst) - length, "\\setusername %s\n", conn->username);
+	}
+	if (conn->channel != NULL && length < (int) sizeof(burst)) {
+		length += snprintf(burst + length, sizeof(burst) - length, "\\join %s\n", conn->channel);
+	}
+	if (conn->channel != NULL && conn->lastSeq > 0 && length < (int) sizeof(burst)) {
+		length += snprintf(burst + length, sizeof(burst) - length, "\\history %lu\n", conn->lastSeq);
+	}
+	if (length >= (int) sizeof(burst) || length == 0) {
+		return;
+	}
+	if (reserve(&conn->output, &conn->outputSize, conn->outputLength + length, MAX_OUTPUT + sizeof(burst)) == -1) {
+		return;
+	}
+	memmove(conn->output + length, conn->output, conn->outputLength);
+	memcpy(conn->output, burst, length);
+	conn->outputLength += length;
+	conn->burstLength = length;
+}
+
+/* Start the reconnections that are due. */
+static void reconnectDue(struct HermesLoop *loop) {
+	long current = now();
+	struct HermesConnection **c = &loop->waitingHead;
+	while (*c != NULL) {
+		struct HermesConnection *conn = *c;
+		if (conn->retryAt <= current) {
+			*c = conn->nextWaiting;
+			reconnect(conn);
+		} else {
+			c = &conn->nextWaiting;
+		}
+	}
+}
+
+/* Milliseconds until the next reconnection attempt is due, -1 if none is pending.
+ * A program polling hermesLoopFD() should not sleep longer than this. */
+int hermesTimeout(struct HermesLoop *loop) {
+	long first = -1;
+	for (struct HermesConnection *conn = loop->waitingHead; conn != NULL; conn = conn->nextWaiting) {
+		if (first == -1 || conn->retryAt < first) {
+			first = conn->retryAt;
+		}
+	}
+	if (first == -1) {
+		return -1;
+	}
+	long remaining = first - now();
+	return remaining > 0 ? remaining : 0;
+}
+
+/* Handle a line before it reaches the user: the server identifier and the session token
+ * are consumed and the sequence numbers tracked, dropping the messages already received.
+ * Return 1 if the line must be delivered. */
+static int track(struct HermesConnection *conn, char *line, int length) {
+	if (strncmp(line, "\\server ", 8) == 0) {
+		if (conn->serverID != NULL && strcmp(conn->serverID, line + 8) != 0) {
+			/* The server restarted, its sequence numbers started over. */
+			conn->lastSeq = 0;
+		}
+		save(&conn->serverID, line + 8, length - 8);
+		return 0;
+	}
+	if (strncmp(line, "\\session ", 9) == 0) {
+		save(&conn->token, line + 9, length - 9);
+		return 0;
+	}
+	if (line[0] == '[') {
+		char *end;
+		unsigned long seq = strtoul(line + 1, &end, 10);
+		if (end != line + 1 && *end == ']') {
+			if (seq <= conn->lastSeq) {
+				/* Received again from history after a reconnect. */
+				return 0;
+			}
+			conn->lastSeq = seq;
+			if (conn->acknowledge) {
+				scheduleFlush(conn);
+			}
+		}
+	}
+	return 1;
+}
+
+/* Read what the server sent, split it in lines and hand every complete line to onMessage. */
+static void receive(struct HermesConnection *conn) {
+	if (reserve(&conn->input, &conn->inputSize, conn->inputLength + READ_CHUNK, MAX_LINE + READ_CHUNK) == -1) {
+		lose(conn);
+		return;
+	}
+	ssize_t n = read(conn->fd, conn->input + conn->inputLength, READ_CHUNK);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		lose(conn);
+		return;
+	}
+	conn->inputLength += n;
+
+	int start = 0;
+	for (int i = 0; i < conn->inputLength && conn->state == STATE_CONNECTED; i++) {
+		/* A line that doesn't fit is delivered in pieces rather than dropped. */
+		if (conn->input[i] == '\n' || i - start == MAX_LINE) {
+			int complete = conn->input[i] == '\n';
+			char saved = conn->input[i];
+			conn->input[i] = '\0';
+			if (track(conn, conn->input + start, i - start) && conn->callbacks.onMessage != NULL) {
+				conn->callbacks.onMessage(conn, conn->input + start, i - start);
+			}
+			conn->input[i] = saved;
+			start = complete ? i + 1 : i;
+		}
+	}
+	if (conn->state != STATE_CONNECTED) {
+		return;
+	}
+	conn->inputLength -= start;
+	memmove(conn->input, conn->input + start, conn->inputLength);
+}
+
+/* Wait up to timeout milliseconds (-1 forever) for events and process them.
+ * Return the number of events processed or -1 on error. */
+int hermesRunOnce(struct HermesLoop *loop, int timeout) {
+	/* Output queued outside of the loop, e.g. before the first iteration, is written right away. */
+	flushAll(loop);
+
+	/* Don't sleep past the next reconnection attempt. */
+	int reconnectTimeout = hermesTimeout(loop);
+	if (reconnectTimeout != -1 && (timeout == -1 || reconnectTimeout < timeout)) {
+		timeout = reconnectTimeout;
+	}
+
+	int numEvents = epoll_wait(loop->epollFD, loop->events, MAX_EVENTS, timeout);
+	if (numEvents == -1) {
+		return errno == EINTR ? 0 : -1;
+	}
+
+	for (int i = 0; i < numEvents; i++) {
+		struct HermesConnection *conn = loop->events[i].data.ptr;
+		uint32_t events = loop->events[i].events;
+
+		if (conn->state == STATE_CONNECTING) {
+			finishConnection(conn);
+			continue;
+		}
+		if (conn->state == STATE_CONNECTED && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+			receive(conn);
+		}
+		if (conn->state == STATE_CONNECTED && (events & EPOLLOUT)) {
+			flush(conn);
+		}
+	}
+	reconnectDue(loop);
+
+	/* Commands issued by the callbacks are written in batch, one write() per connection. */
+	flushAll(loop);
+
+	while (loop->closedHead != NULL) {
+		struct HermesConnection *conn = loop->closedHead;
+		loop->closedHead = conn->nextClosed;
+		release(conn);
+	}
+	return numEvents;
+}
+
+/* Process events until hermesStop() is called or the loop has no connections left. */
+void hermesRun(struct HermesLoop *loop) {
+	loop->running = 1;
+	while (loop->running && loop->head != NULL) {
+		if (hermesRunOnce(loop, -1) == -1) {
+			break;
+		}
+	}
+}
+
+void hermesStop(struct HermesLoop *loop) {
+	loop->running = 0;
+}
+
+/* Close every connection and release the loop. */
+void hermesDestroyLoop(struct HermesLoop *loop) {
+	for (struct HermesConnection *conn = loop->head; conn != NULL; conn = conn->nextInLoop) {
+		conn->minDelay = 0;
+		hermesClose(conn);
+	}
+	while (loop->closedHead != NULL) {
+		struct HermesConnection *conn = loop->closedHead;
+		loop->closedHead = conn->nextClosed;
+		release(conn);
+	}
+	close(loop->epollFD);
+	free(loop);
+}
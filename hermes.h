@@ -0,0 +1,77 @@
+/*
+ * hermes.h - asynchronous client library for the chat server
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HERMES_H
+#define HERMES_H
+
+/* A loop multiplexes any number of connections on a single epoll instance.
+ * Nothing blocks: commands are queued on the connection and written in batch
+ * once per loop iteration, replies are delivered line by line to the callbacks. */
+struct HermesLoop;
+struct HermesConnection;
+
+/* Every callback is optional. The line passed to onMessage is NUL-terminated,
+ * without the trailing '\n', and it is valid only during the call.
+ * With reconnection enabled onDisconnect is followed by onConnect once the
+ * connection is established again; username and channel are restored automatically. */
+struct HermesCallbacks {
+	void (*onConnect)(struct HermesConnection *conn);
+	void (*onMessage)(struct HermesConnection *conn, char *line, int length);
+	void (*onDisconnect)(struct HermesConnection *conn);
+};
+
+struct HermesLoop *hermesCreateLoop();
+
+void hermesDestroyLoop(struct HermesLoop *loop);
+
+int hermesRunOnce(struct HermesLoop *loop, int timeout);
+
+void hermesRun(struct HermesLoop *loop);
+
+void hermesStop(struct HermesLoop *loop);
+
+void hermesSetFastOpen(struct HermesLoop *loop, int enabled);
+
+int hermesLoopFD(struct HermesLoop *loop);
+
+int hermesTimeout(struct HermesLoop *loop);
+
+struct HermesConnection *hermesConnect(struct HermesLoop *loop, char *ip, int port,
+		struct HermesCallbacks *callbacks, void *userData);
+
+void hermesClose(struct HermesConnection *conn);
+
+void hermesSetReconnect(struct HermesConnection *conn, int minDelay, int maxDelay);
+
+void hermesSetAcknowledge(struct HermesConnection *conn, int enabled);
+
+void *hermesUserData(struct HermesConnection *conn);
+
+unsigned long hermesLastSeq(struct HermesConnection *conn);
+
+int hermesSend(struct HermesConnection *conn, char *text);
+
+int hermesSendWithId(struct HermesConnection *conn, char *id, char *text);
+
+int hermesCommand(struct HermesConnection *conn, char *format, ...);
+
+int hermesSetUsername(struct HermesConnection *conn, char *username);
+
+int hermesJoin(struct HermesConnection *conn, char *channel);
+
+#endif
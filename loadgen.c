@@ -0,0 +1,392 @@
+/*
+ * loadgen.c - synthetic workload for the chat server
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hermes.h"
+#include "spawn.h"
+
+#define DEFAULT_PORT 50002
+/* Messages a bot may have in flight, that is sent and not yet seen by the listener of its channel. */
+#define WINDOW 8
+/* The mix of the workload: out of 1000 actions of a bot, these many are not a message. */
+#define RENAME_PER_MILLE 10
+#define SWITCH_PER_MILLE 5
+#define RECONNECT_PER_MILLE 2
+/* After the run we wait for the last deliveries up to this long. */
+#define DRAIN_MS 1000
+/* Idle bots connect this many at a time, see idleMemory(). */
+#define IDLE_BATCH 50
+
+/* Every channel has a listener that never talks: it sees every message of the channel,
+ * so it tells the bots when their messages have been delivered. The bots do everything
+ * else: they talk, rename themselves, move to other channels and reconnect. */
+struct Bot {
+	int id;
+	struct HermesConnection *conn;
+	int channel;
+	int connected;
+	int inFlight;
+	int renames;
+	long sent;
+};
+
+struct Bot *bots;
+int numBots = 200;
+int numChannels = 10;
+/* Every action is a reconnection, to measure how fast the server accepts connections. */
+int churn;
+struct HermesLoop *loop;
+char *ip = "127.0.0.1";
+int port = DEFAULT_PORT;
+
+/* Latencies of the messages seen by the listeners, from the bot acting to the listener
+ * receiving, in microseconds. */
+long *latencies;
+long numLatencies;
+long latenciesSize;
+
+long delivered;
+long sent;
+long renames;
+long switches;
+long reconnects;
+
+long nowUs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+void onConnect(struct HermesConnection *conn) {
+	struct Bot *bot = hermesUserData(conn);
+	bot->connected = 1;
+}
+
+void addLatency(long latency) {
+	if (numLatencies == latenciesSize) {
+		latenciesSize = latenciesSize == 0 ? 65536 : latenciesSize * 2;
+		latencies = realloc(latencies, latenciesSize * sizeof(*latencies));
+	}
+	latencies[numLatencies++] = latency;
+}
+
+/* Messages are "[seq] bot<id>-<renames>> message <n> from bot <id> at <time>": the listener of
+ * the channel measures their latency and gives their bot one more message in flight. */
+void onMessage(struct HermesConnection *conn, char *line, int length) {
+	(void) length;
+	if (line[0] != '[') {
+		return;
+	}
+	delivered++;
+	struct Bot *receiver = hermesUserData(conn);
+	if (receiver->id >= 0) {
+		return;
+	}
+	char *name = strchr(line, ' ');
+	if (name == NULL || strncmp(name + 1, "bot", 3) != 0) {
+		return;
+	}
+	int id = atoi(name + 4);
+	if (id >= 0 && id < numBots && bots[id].inFlight > 0) {
+		bots[id].inFlight--;
+	}
+	char *at = strstr(line, " at ");
+	if (at != NULL) {
+		addLatency(nowUs() - atol(at + 4));
+	}
+}
+
+void connectBot(struct Bot *bot);
+
+/* A bot that said \exit comes back with a new connection. */
+void onDisconnect(struct HermesConnection *conn) {
+	struct Bot *bot = hermesUserData(conn);
+	if (bot->id >= 0) {
+		connectBot(bot);
+	}
+}
+
+struct HermesCallbacks callbacks = { onConnect, onMessage, onDisconnect };
+
+void connectBot(struct Bot *bot) {
+	bot->conn = hermesConnect(loop, ip, port, &callbacks, bot);
+	bot->connected = 0;
+	bot->inFlight = 0;
+	if (bot->id >= 0) {
+		hermesCommand(bot->conn, "\\setusername bot%d-%d", bot->id, bot->renames);
+	} else {
+		hermesCommand(bot->conn, "\\setusername listener%d", bot->channel);
+	}
+	hermesCommand(bot->conn, "\\join channel%d", bot->channel);
+}
+
+/* One action of a bot: usually a message, sometimes something else. */
+void act(struct Bot *bot) {
+	int r = churn ? RENAME_PER_MILLE + SWITCH_PER_MILLE : rand() % 1000;
+	if (r < RENAME_PER_MILLE) {
+		bot->renames++;
+		hermesCommand(bot->conn, "\\setusername bot%d-%d", bot->id, bot->renames);
+		renames++;
+	} else if (r < RENAME_PER_MILLE + SWITCH_PER_MILLE) {
+		/* Messages in flight are delivered in the old channel, they are just not counted anymore. */
+		bot->channel = rand() % numChannels;
+		bot->inFlight = 0;
+		hermesCommand(bot->conn, "\\join channel%d", bot->channel);
+		switches++;
+	} else if (r < RENAME_PER_MILLE + SWITCH_PER_MILLE + RECONNECT_PER_MILLE) {
+		bot->connected = 0;
+		hermesCommand(bot->conn, "\\exit");
+		reconnects++;
+	} else {
+		hermesCommand(bot->conn, "message %ld from bot %d at %ld", bot->sent, bot->id, nowUs());
+		bot->sent++;
+		bot->inFlight++;
+		sent++;
+	}
+}
+
+/* Connect the bots from first to last, IDLE_BATCH at a time, running the loop until every batch is
+ * connected and the server is done with it. */
+void connectIdle(int first, int last) {
+	for (int batch = first; batch < last; batch += IDLE_BATCH) {
+		int end = batch + IDLE_BATCH < last ? batch + IDLE_BATCH : last;
+		for (int i = batch; i < end; i++) {
+			connectBot(&bots[i]);
+		}
+		for (int i = batch; i < end; i++) {
+			while (!bots[i].connected) {
+				hermesRunOnce(loop, 10);
+			}
+		}
+		long settled = nowUs() + 100000;
+		while (nowUs() < settled) {
+			hermesRunOnce(loop, 10);
+		}
+	}
+}
+
+/* The memory of the server per idle connection: bots that joined a channel and keep quiet. It is
+ * measured as the growth of its resident memory from a tenth of the bots to all of them, so that
+ * what is allocated once, like the first slab of a pool, doesn't count. The bots connect in small
+ * batches: the buffers a storm of connections takes at once go back to the pools, but the pools
+ * keep their memory, and that's the footprint of the storm rather than of the idle connections. */
+double idleMemory(pid_t serverPID) {
+	bots = calloc(numBots, sizeof(*bots));
+	int first = numBots / 10;
+	for (int i = 0; i < numBots; i++) {
+		bots[i].id = i;
+		bots[i].channel = i % numChannels;
+	}
+	connectIdle(0, first);
+	long before = processMemory(serverPID);
+	connectIdle(first, numBots);
+	long after = processMemory(serverPID);
+	return (double) (after - before) / (numBots - first);
+}
+
+int compareLong(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+long percentile(double p) {
+	if (numLatencies == 0) {
+		return 0;
+	}
+	return latencies[(long) (p * (numLatencies - 1))];
+}
+
+void usage() {
+	fprintf(stderr,
+		"Usage: loadgen [-c bots] [-n channels] [-d seconds] [-r rate] [-a] [-F] [-i] [-x server] [-o options] [-p port] [-e] [-q]\n"
+		"  -c bots      clients talking (default 200)\n"
+		"  -n channels  channels, each with a listening client (default 10)\n"
+		"  -d seconds   duration of the run (default 5)\n"
+		"  -r rate      actions per second of all the bots together, 0 as many as possible (default 0)\n"
+		"  -a           reconnect on every action instead, measuring the accept rate\n"
+		"  -F           connect with TCP Fast Open\n"
+		"  -i           keep the bots idle instead, measuring the memory of the server per connection\n"
+		"  -x server    server executable to start (default ./server)\n"
+		"  -o options   options of the server, e.g. \"-b 50\"\n"
+		"  -p port      port of the server (default %d)\n"
+		"  -e           use a server already running on port instead of starting one\n"
+		"  -q           print only the deliveries per second of server CPU\n",
+		DEFAULT_PORT);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	double duration = 5;
+	double rate = 0;
+	char *serverPath = "./server";
+	char *serverOptions = NULL;
+	int existing = 0;
+	int quiet = 0;
+	int fastOpen = 0;
+	int idle = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:d:r:aFix:o:p:eq")) != -1) {
+		switch (opt) {
+		case 'c':
+			numBots = atoi(optarg);
+			break;
+		case 'n':
+			numChannels = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'a':
+			churn = 1;
+			break;
+		case 'F':
+			fastOpen = 1;
+			break;
+		case 'i':
+			idle = 1;
+			break;
+		case 'x':
+			serverPath = optarg;
+			break;
+		case 'o':
+			serverOptions = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'e':
+			existing = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || numBots < 1 || numChannels < 1 || duration <= 0 || rate < 0 || (idle && existing)) {
+		usage();
+	}
+
+	pid_t serverPID = existing ? 0 : startServer(serverPath, port, serverOptions);
+	loop = hermesCreateLoop();
+	hermesSetFastOpen(loop, fastOpen);
+	srand(1);
+
+	if (idle) {
+		double perConnection = idleMemory(serverPID);
+		hermesDestroyLoop(loop);
+		stopServer(serverPID);
+		if (quiet) {
+			printf("%.0f\n", perConnection);
+		} else {
+			printf("idle memory: %.0f bytes per connection, %d connections\n", perConnection, numBots);
+		}
+		return 0;
+	}
+
+	struct Bot *listeners = calloc(numChannels, sizeof(*listeners));
+	for (int i = 0; i < numChannels; i++) {
+		listeners[i].id = -1;
+		listeners[i].channel = i;
+		connectBot(&listeners[i]);
+	}
+	bots = calloc(numBots, sizeof(*bots));
+	for (int i = 0; i < numBots; i++) {
+		bots[i].id = i;
+		bots[i].channel = i % numChannels;
+		connectBot(&bots[i]);
+	}
+
+	double serverCPUStart = existing ? 0 : processCPU(serverPID);
+	struct rusage usageStart, usageEnd;
+	getrusage(RUSAGE_SELF, &usageStart);
+	long start = nowUs();
+	long end = start + (long) (duration * 1000000);
+
+	/* Every bot acts as long as its window allows, then the loop collects what is delivered.
+	 * With a rate the bots take turns, acting only when the next action is due. */
+	long actions = 0;
+	int turn = 0;
+	while (nowUs() < end) {
+		long due = rate > 0 ? (long) ((nowUs() - start) * rate / 1e6) + 1 : -1;
+		for (int i = 0; i < numBots && (due == -1 || actions < due); i++) {
+			struct Bot *bot = &bots[rate > 0 ? turn++ % numBots : i];
+			if (bot->connected && bot->inFlight < WINDOW) {
+				act(bot);
+				actions++;
+			}
+		}
+		int timeout = 1;
+		if (rate > 0 && actions >= due) {
+			/* Sleep until the next action, unless something arrives. */
+			long next = start + (long) (actions * 1e6 / rate);
+			timeout = next > nowUs() ? (next - nowUs() + 999) / 1000 : 0;
+		}
+		hermesRunOnce(loop, timeout);
+	}
+	long drainEnd = nowUs() + DRAIN_MS * 1000;
+	long lastDelivered = -1;
+	while (delivered != lastDelivered && nowUs() < drainEnd) {
+		lastDelivered = delivered;
+		hermesRunOnce(loop, 100);
+	}
+	double elapsed = (nowUs() - start) / 1e6;
+
+	getrusage(RUSAGE_SELF, &usageEnd);
+	double serverCPU = existing ? 0 : processCPU(serverPID) - serverCPUStart;
+	double loadgenCPU = (usageEnd.ru_utime.tv_sec - usageStart.ru_utime.tv_sec)
+		+ (usageEnd.ru_stime.tv_sec - usageStart.ru_stime.tv_sec)
+		+ ((usageEnd.ru_utime.tv_usec - usageStart.ru_utime.tv_usec)
+		+ (usageEnd.ru_stime.tv_usec - usageStart.ru_stime.tv_usec)) / 1e6;
+	hermesDestroyLoop(loop);
+	if (!existing) {
+		stopServer(serverPID);
+	}
+
+	double perServerCPU = serverCPU > 0 ? delivered / serverCPU : 0;
+	if (quiet) {
+		printf("%.0f\n", perServerCPU);
+		return 0;
+	}
+	printf("bots:        %d in %d channels for %.1f s\n", numBots, numChannels, elapsed);
+	printf("actions:     %ld messages, %ld renames, %ld channel switches, %ld reconnects\n",
+		sent, renames, switches, reconnects);
+	printf("throughput:  %ld delivered, %.0f deliveries/s\n", delivered, delivered / elapsed);
+	qsort(latencies, numLatencies, sizeof(*latencies), compareLong);
+	if (churn && !existing) {
+		printf("accepts:     %.0f reconnects/s, %.1f us of server cpu each\n",
+			reconnects / elapsed, reconnects > 0 ? serverCPU * 1e6 / reconnects : 0);
+	}
+	printf("latency us:  p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+		percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), percentile(1));
+	if (!existing) {
+		printf("server cpu:  %.3f s, %.0f deliveries per cpu second\n", serverCPU, perServerCPU);
+	}
+	printf("loadgen cpu: %.3f s\n", loadgenCPU);
+	return 0;
+}
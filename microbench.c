@@ -0,0 +1,491 @@
+/*
+ * microbench.c - microbenchmarks of the chat data structures
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* syscall() for perf_event_open, which has no libc wrapper. */
+#define _GNU_SOURCE
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chat.h"
+#include "filter.h"
+
+/* Sizes go from 10 to MAX_SIZE entries, ten times larger at every step. */
+#define MAX_SIZE 1000000
+/* The filter is compiled with this many patterns at most, its tables grow with them. */
+#define MAX_PATTERNS 10000
+/* Lookups are timed on this many operations at most, whatever the size. */
+#define MAX_LOOKUPS 200000
+/* Benchmarks on small sizes are repeated until they measure this many operations. */
+#define MIN_OPS 100000
+/* Sizes grow tenfold and so do the chains of the hashtables: a run may take up to a hundred
+ * times longer than the one at the previous size. Runs expected to take longer than this are skipped. */
+#define BUDGET_NS 30000000000LL
+
+/* The data structures are linked without the server loop: there is no connection to close
+ * and channels are numbered from the start. */
+void closeConnection(int fd) {
+	(void) fd;
+}
+
+unsigned long channelStart(char *name) {
+	(void) name;
+	return 0;
+}
+
+/* The hardware counter of cache misses, -1 when perf events are not available. */
+int missesFD = -1;
+
+/* The measurement of the running benchmark: stopMeasure() stores the result in
+ * measuredNS and measuredMisses. */
+struct timespec startTime;
+long long startMisses;
+long long measuredNS;
+long long measuredMisses;
+
+/* Keys used by every benchmark, built once: usernames, tokens and channel names. */
+char **usernames;
+char **tokens;
+char **channels;
+/* A random permutation of 0..size-1, so that lookups and removals don't follow insertion order. */
+int *order;
+
+/* A benchmark runs on size entries and returns the number of operations measured,
+ * or -1 when it doesn't apply to that size. */
+struct Benchmark {
+	char *name;
+	long long (*run)(int size);
+	/* The duration of the last run, see BUDGET_NS. */
+	long long lastNS;
+};
+
+void openMissesCounter() {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	missesFD = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (missesFD == -1) {
+		perror("perf_event_open, cache misses not measured");
+	}
+}
+
+long long readMisses() {
+	long long misses = 0;
+	if (missesFD != -1 && read(missesFD, &misses, sizeof(misses)) != sizeof(misses)) {
+		misses = 0;
+	}
+	return misses;
+}
+
+long long elapsedNS(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000000LL + end->tv_nsec - start->tv_nsec;
+}
+
+void startMeasure() {
+	if (missesFD != -1) {
+		ioctl(missesFD, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	startMisses = readMisses();
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+}
+
+void stopMeasure() {
+	struct timespec endTime;
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+	measuredMisses = readMisses() - startMisses;
+	if (missesFD != -1) {
+		ioctl(missesFD, PERF_EVENT_IOC_DISABLE, 0);
+	}
+	measuredNS = elapsedNS(&startTime, &endTime);
+}
+
+char *formatKey(char *format, unsigned int i) {
+	int length = snprintf(NULL, 0, format, i) + 1;
+	char *key = malloc(length);
+	snprintf(key, length, format, i);
+	return key;
+}
+
+void createKeys(int maxSize) {
+	usernames = malloc(maxSize * sizeof(*usernames));
+	tokens = malloc(maxSize * sizeof(*tokens));
+	channels = malloc(maxSize * sizeof(*channels));
+	order = malloc(maxSize * sizeof(*order));
+	for (int i = 0; i < maxSize; i++) {
+		usernames[i] = formatKey("user%u", i);
+		tokens[i] = formatKey("%032x", i * 2654435761u);
+		channels[i] = formatKey("channel%u", i);
+	}
+}
+
+/* Fill order with a permutation of 0..size-1, with a fixed seed so runs are comparable. */
+void shuffle(int size) {
+	srand(1);
+	for (int i = 0; i < size; i++) {
+		order[i] = i;
+	}
+	/* Fisher-Yates */
+	for (int i = size - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		int t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+}
+
+/* Create size clients with their usernames in clientHashtable. */
+struct Client **createClients(int size) {
+	struct Client **clients = malloc(size * sizeof(*clients));
+	for (int i = 0; i < size; i++) {
+		clients[i] = allocClient();
+		clients[i]->session->username = strdup(usernames[i]);
+	}
+	return clients;
+}
+
+/* Release the clients made by createClients(), removing them from clientHashtable. */
+void destroyClients(struct Client **clients, int size) {
+	for (int i = 0; i < size; i++) {
+		deleteClientByUsername(clients[i]->session->username);
+		releaseClient(clients[i]);
+	}
+	free(clients);
+}
+
+/* Lookups are limited to MAX_LOOKUPS, the entries looked up are spread over the whole set. */
+int lookups(int size) {
+	return size < MAX_LOOKUPS ? size : MAX_LOOKUPS;
+}
+
+long long runHash(int size) {
+	int total = size < MAX_LOOKUPS ? MAX_LOOKUPS : size;
+	volatile int sink = 0;
+	startMeasure();
+	for (int i = 0; i < total; i++) {
+		sink += hash(usernames[i % size], MAX_CLIENTS);
+	}
+	stopMeasure();
+	return total;
+}
+
+long long runInsertClient(int size) {
+	struct Client **clients = createClients(size);
+	startMeasure();
+	for (int i = 0; i < size; i++) {
+		insertClient(clients[i]->session->username, clients[i]);
+	}
+	stopMeasure();
+	destroyClients(clients, size);
+	return size;
+}
+
+/* Look up every username in random order, or as many names that aren't there when miss is set. */
+long long runGetClient(int size, int miss) {
+	struct Client **clients = createClients(size);
+	for (int i = 0; i < size; i++) {
+		insertClient(clients[i]->session->username, clients[i]);
+	}
+	char **keys = miss ? channels : usernames;
+	int total = lookups(size);
+	int found = 0;
+	startMeasure();
+	for (int i = 0; i < total; i++) {
+		found += getClientByUsername(keys[order[i]]) != NULL;
+	}
+	stopMeasure();
+	if (found != (miss ? 0 : total)) {
+		fprintf(stderr, "getClientByUsername: %d of %d lookups found a client\n", found, total);
+	}
+	destroyClients(clients, size);
+	return total;
+}
+
+long long runGetClientHit(int size) {
+	return runGetClient(size, 0);
+}
+
+long long runGetClientMiss(int size) {
+	return runGetClient(size, 1);
+}
+
+/* Insert size channels, measuring the insertions or the lookups that follow. */
+long long runChannels(int size, int lookup) {
+	struct Channel **created = malloc(size * sizeof(*created));
+	for (int i = 0; i < size; i++) {
+		created[i] = calloc(1, sizeof(*created[i]));
+		created[i]->name = strdup(channels[i]);
+	}
+	if (!lookup) {
+		startMeasure();
+	}
+	for (int i = 0; i < size; i++) {
+		insertChannel(channels[i], created[i]);
+	}
+	int total = size;
+	if (lookup) {
+		total = lookups(size);
+		int found = 0;
+		startMeasure();
+		for (int i = 0; i < total; i++) {
+			found += getChannelByName(channels[order[i]]) != NULL;
+		}
+		stopMeasure();
+		if (found != total) {
+			fprintf(stderr, "getChannelByName: %d of %d channels found\n", found, total);
+		}
+	} else {
+		stopMeasure();
+	}
+
+	/* Channels are never removed by the server: the hashtable is emptied here. */
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		while (channelHashtable[i] != NULL) {
+			struct ChannelBucket *b = channelHashtable[i];
+			channelHashtable[i] = b->nextInChat;
+			free(b->key);
+			free(b);
+		}
+	}
+	for (int i = 0; i < size; i++) {
+		free(created[i]->name);
+		free(created[i]);
+	}
+	free(created);
+	return total;
+}
+
+long long runInsertChannel(int size) {
+	return runChannels(size, 0);
+}
+
+long long runGetChannel(int size) {
+	return runChannels(size, 1);
+}
+
+/* Release size clients in random order. They are spread over ten channels and have
+ * a session, so every list and hashtable a client belongs to is updated. */
+long long runFreeClient(int size, int detached) {
+	struct Client **clients = malloc(size * sizeof(*clients));
+	for (int i = 0; i < size; i++) {
+		struct Client *client = allocClient();
+		client->session->username = strdup(usernames[i]);
+		client->session->token = strdup(tokens[i]);
+		insertClient(client->session->username, client);
+		insertSession(client->session->token, client);
+		joinChannel(client, channels[i % 10]);
+		if (detached) {
+			addToDetached(client);
+		} else {
+			addToChat(client, -1);
+		}
+		clients[i] = client;
+	}
+	startMeasure();
+	for (int i = 0; i < size; i++) {
+		freeClient(clients[order[i]]);
+	}
+	stopMeasure();
+	free(clients);
+	return size;
+}
+
+/* Connected clients are at most MAX_CLIENTS, as the entries of fds. */
+long long runFreeConnected(int size) {
+	if (size > MAX_CLIENTS) {
+		return -1;
+	}
+	return runFreeClient(size, 0);
+}
+
+long long runFreeDetached(int size) {
+	return runFreeClient(size, 1);
+}
+
+/* Lines like the ones of a chat. */
+char *sampleLines[] = {
+	"hello everyone, is anybody around tonight?",
+	"message 1234 from bot 17 at 1697568000123456",
+	"I pushed the fix, can you have a look at the last commit before the release",
+	"ok",
+	"lunch at noon? the usual place works for me, I'll book a table",
+	"The build is green again, thanks to everyone who helped with the flaky tests today",
+};
+
+/* Filter chat lines against size random lowercase words of 4 to 10 letters. */
+long long runFilter(int size) {
+	if (size > MAX_PATTERNS) {
+		return -1;
+	}
+	srand(size);
+	char **patterns = malloc(size * sizeof(*patterns));
+	for (int i = 0; i < size; i++) {
+		int length = 4 + rand() % 7;
+		patterns[i] = malloc(length + 1);
+		for (int k = 0; k < length; k++) {
+			patterns[i][k] = 'a' + rand() % 26;
+		}
+		patterns[i][length] = '\0';
+	}
+	struct Filter *filter = filterCompile(patterns, size);
+	int numLines = sizeof(sampleLines) / sizeof(sampleLines[0]);
+	int lengths[numLines];
+	for (int i = 0; i < numLines; i++) {
+		lengths[i] = strlen(sampleLines[i]);
+	}
+	int total = MAX_LOOKUPS;
+	volatile int sink = 0;
+	startMeasure();
+	for (int i = 0; i < total; i++) {
+		sink += filterMatch(filter, sampleLines[i % numLines], lengths[i % numLines]);
+	}
+	stopMeasure();
+	filterFree(filter);
+	for (int i = 0; i < size; i++) {
+		free(patterns[i]);
+	}
+	free(patterns);
+	return total;
+}
+
+/* The loop of fanOutNext(): size members, joined in random order, are checked against a message. */
+long long runFanOutScan(int size) {
+	struct Client **clients = createClients(size);
+	for (int i = 0; i < size; i++) {
+		joinChannel(clients[order[i]], "fanout");
+		clients[order[i]]->ackedSeq = i % 2;
+	}
+	struct Channel *channel = getChannelByName("fanout");
+	unsigned long seq = 1;
+	int fanout = 0;
+	startMeasure();
+	for (int i = 0; i < channel->numMembers; i++) {
+		struct Client *c = channel->members[i];
+		fanout += seq > c->ackedSeq && seq > c->historySeq;
+	}
+	stopMeasure();
+	if (fanout != size / 2) {
+		fprintf(stderr, "fan-out scan: %d of %d members\n", fanout, size);
+	}
+	for (int i = 0; i < size; i++) {
+		removeFromChannel(clients[i]);
+	}
+	destroyClients(clients, size);
+	return size;
+}
+
+/* The loop of flushAll(): size connected clients, added in random order, one in ten with output. */
+long long runFlushScan(int size) {
+	if (size > MAX_CLIENTS) {
+		return -1;
+	}
+	struct Client **clients = createClients(size);
+	for (int i = 0; i < size; i++) {
+		addToChat(clients[order[i]], -1);
+		if (i % 10 == 0) {
+			outputPending[clients[order[i]]->fdsIndex] = 1;
+		}
+	}
+	int pending = 0;
+	startMeasure();
+	for (int i = 1; i <= numClients; i++) {
+		pending += outputPending[i] && !(fds[i].events & POLLOUT);
+	}
+	stopMeasure();
+	if (pending != (size + 9) / 10) {
+		fprintf(stderr, "flush scan: %d of %d clients\n", pending, size);
+	}
+	for (int i = 0; i < size; i++) {
+		removeFromChat(clients[i]);
+	}
+	destroyClients(clients, size);
+	return size;
+}
+
+struct Benchmark benchmarks[] = {
+	{ "hash", runHash, 0 },
+	{ "insertClient", runInsertClient, 0 },
+	{ "getClientByUsername", runGetClientHit, 0 },
+	{ "getClientByUsername miss", runGetClientMiss, 0 },
+	{ "insertChannel", runInsertChannel, 0 },
+	{ "getChannelByName", runGetChannel, 0 },
+	{ "freeClient connected", runFreeConnected, 0 },
+	{ "freeClient detached", runFreeDetached, 0 },
+	{ "filterMatch", runFilter, 0 },
+	{ "fan-out scan", runFanOutScan, 0 },
+	{ "flush scan", runFlushScan, 0 },
+};
+
+int main(int argc, char **argv) {
+	int maxSize = argc > 1 ? atoi(argv[1]) : MAX_SIZE;
+	if (maxSize < 10 || maxSize > MAX_SIZE) {
+		fprintf(stderr, "Usage: %s [max size, 10 to %d]\n", argv[0], MAX_SIZE);
+		exit(EXIT_FAILURE);
+	}
+	openMissesCounter();
+	createKeys(maxSize);
+
+	printf("%-26s %8s %8s %10s %10s\n", "benchmark", "size", "ops", "ns/op", "misses/op");
+	int numBenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	for (int b = 0; b < numBenchmarks; b++) {
+		struct Benchmark *benchmark = &benchmarks[b];
+		for (int size = 10; size <= maxSize; size *= 10) {
+			if (benchmark->lastNS * 100 > BUDGET_NS) {
+				printf("%-26s %8d %8s\n", benchmark->name, size, "skipped");
+				continue;
+			}
+			shuffle(size);
+			long long ops = 0, totalNS = 0, totalMisses = 0;
+			struct timespec begin, end;
+			clock_gettime(CLOCK_MONOTONIC, &begin);
+			while (ops < MIN_OPS) {
+				long long runOps = benchmark->run(size);
+				if (runOps < 0) {
+					ops = -1;
+					break;
+				}
+				ops += runOps;
+				totalNS += measuredNS;
+				totalMisses += measuredMisses;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			benchmark->lastNS = elapsedNS(&begin, &end);
+			if (ops < 0) {
+				printf("%-26s %8d %8s\n", benchmark->name, size, "n/a");
+				continue;
+			}
+			printf("%-26s %8d %8lld %10.1f ", benchmark->name, size, ops, (double) totalNS / ops);
+			if (missesFD == -1) {
+				printf("%10s\n", "-");
+			} else {
+				printf("%10.2f\n", (double) totalMisses / ops);
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * pool.c - pools of fixed size objects
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* syscall() for mbind, which has no libc wrapper without libnuma, and MAP_HUGETLB. */
+#define _GNU_SOURCE
+
+#include <linux/mempolicy.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+/* The NUMA node slabs are placed on, -1 for the default policy of the system. */
+int poolNode = -1;
+
+/* Whether slabs are backed by huge pages: explicit ones (MAP_HUGETLB) while the system has
+ * some reserved, transparent ones otherwise. */
+int poolHugePages = 0;
+
+/* Place the slabs allocated from now on in the memory of a NUMA node, typically the one
+ * local to the CPU the server runs on. */
+void poolSetNode(int node) {
+	poolNode = node;
+}
+
+/* Back the slabs allocated from now on with huge pages: a slab is then a single TLB entry
+ * instead of 512, which matters when walking many objects, as broadcasts do. */
+void poolSetHugePages(int enabled) {
+	poolHugePages = enabled;
+}
+
+/* Map a slab aligned to its size, so that the kernel can back it with a transparent huge page. */
+static char *mapAligned() {
+	char *area = mmap(NULL, 2 * POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	char *slab = (char *) (((uintptr_t) area + POOL_SLAB_SIZE - 1) & ~((uintptr_t) POOL_SLAB_SIZE - 1));
+	if (slab > area) {
+		munmap(area, slab - area);
+	}
+	munmap(slab + POOL_SLAB_SIZE, area + POOL_SLAB_SIZE - slab);
+	madvise(slab, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+	return slab;
+}
+
+/* Map a new slab. Its pages are bound to poolNode before being touched, since the node
+ * of a page is decided by the first access. */
+static char *mapSlab() {
+	char *slab = MAP_FAILED;
+	if (poolHugePages == 1) {
+		slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (slab == MAP_FAILED) {
+			/* No more reserved huge pages (see /proc/sys/vm/nr_hugepages): don't try again. */
+			perror("MAP_HUGETLB failed, using transparent huge pages");
+			poolHugePages = 2;
+		}
+	}
+	if (slab == MAP_FAILED && poolHugePages) {
+		slab = mapAligned();
+	}
+	if (slab == MAP_FAILED && !poolHugePages) {
+		slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (slab == MAP_FAILED) {
+		perror("Cannot allocate a pool slab");
+		exit(EXIT_FAILURE);
+	}
+	if (poolNode >= 0 && poolNode < (int) (8 * sizeof(unsigned long))) {
+		unsigned long nodeMask = 1UL << poolNode;
+		/* A preference rather than a binding: when the node is full we get remote memory
+		 * instead of failing. */
+		if (syscall(SYS_mbind, slab, POOL_SLAB_SIZE, MPOL_PREFERRED, &nodeMask, 8 * sizeof(nodeMask), 0) == -1) {
+			perror("mbind error");
+			poolNode = -1;
+		}
+	}
+	return slab;
+}
+
+/* Take the next object never used from the current slab, mapping a new slab when it's exhausted. */
+static void *carve(struct Pool *pool) {
+	if (pool->next == NULL || pool->end - pool->next < (ptrdiff_t) pool->objectSize) {
+		pool->next = mapSlab();
+		pool->end = pool->next + POOL_SLAB_SIZE;
+		pool->slabs++;
+	}
+	void *object = pool->next;
+	pool->next += pool->objectSize;
+	return object;
+}
+
+/* Make room for count more objects right away, so that the memory is mapped, placed and
+ * faulted in at startup rather than while serving. They are handed out in address order. */
+void poolReserve(struct Pool *pool, size_t count) {
+	void *head = NULL;
+	void **link = &head;
+	for (size_t i = 0; i < count; i++) {
+		void *object = carve(pool);
+		*link = object;
+		link = (void **) object;
+	}
+	*link = pool->freeList;
+	pool->freeList = head;
+}
+
+/* Get a zeroed object from the pool: a released one if any, otherwise a new one. */
+void *poolAlloc(struct Pool *pool) {
+	void *object = pool->freeList;
+	if (object != NULL) {
+		pool->freeList = *(void **) object;
+	} else {
+		object = carve(pool);
+	}
+	return memset(object, 0, pool->objectSize);
+}
+
+/* Give an object back to its pool. */
+void poolFree(struct Pool *pool, void *object) {
+	if (object != NULL) {
+		*(void **) object = pool->freeList;
+		pool->freeList = object;
+	}
+}
@@ -0,0 +1,32 @@
+/* Pools of fixed size objects, for the structures the server allocates and releases all the
+ * time. Objects are carved from large slabs, so they are packed together, and released objects
+ * are reused first while still in cache. Slabs are never returned to the system.
+ * A pool is declared statically, e.g. struct Pool clientPool = POOL(struct Client); */
+
+#include <stddef.h>
+
+/* Memory is requested to the system in slabs of this size, that of a huge page on x86-64. */
+#define POOL_SLAB_SIZE (2 * 1024 * 1024)
+
+struct Pool {
+	size_t objectSize;
+	/* Released objects, linked through their first bytes. */
+	void *freeList;
+	/* The part of the last slab never used yet. */
+	char *next;
+	char *end;
+	size_t slabs;
+};
+
+/* Objects are rounded up to a multiple of the pointer size, which also makes room for the link. */
+#define POOL(type) { (sizeof(type) + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *), NULL, NULL, NULL, 0 }
+
+void poolSetNode(int node);
+
+void poolSetHugePages(int enabled);
+
+void poolReserve(struct Pool *pool, size_t count);
+
+void *poolAlloc(struct Pool *pool);
+
+void poolFree(struct Pool *pool, void *object);
@@ -0,0 +1,14 @@
+/* Static tracepoints of the server, for bpftrace, perf or SystemTap: see tracing/.
+ * With <sys/sdt.h> (HAVE_SYS_SDT_H, set by the Makefile when the header is installed) a probe
+ * is a single nop plus a note in the executable, enabled by the tracer at run time.
+ * Without it probes compile to nothing. Names use "__" as in DTrace: bpftrace shows
+ * command__start as is, perf and SystemTap as command-start. */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(hermes, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(hermes, name, a, b)
+#else
+#define PROBE1(name, a) ((void) sizeof(a))
+#define PROBE2(name, a, b) ((void) sizeof(a), (void) sizeof(b))
+#endif
@@ -0,0 +1,376 @@
+/*
+ * replay.c - re-drive a traffic capture against a fresh server
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "socketlib.h"
+#include "spawn.h"
+
+#define DEFAULT_PORT 50002
+#define MAX_EVENTS 256
+#define LINE_SIZE 2048
+/* Send times of the messages, by hash of their text: when a message is delivered the entry
+ * tells how long it took. Texts sent more than once only keep the last send time. */
+#define SENT_TABLE_SIZE (1 << 20)
+/* After the last record we wait for deliveries until none arrives for this long. */
+#define DRAIN_IDLE_MS 1000
+#define DRAIN_MAX_MS 10000
+
+/* A connection of the capture, replayed by a socket of ours. Lines are split on both
+ * directions: the ones we send to know what to wait for, the ones we receive to
+ * recognize the messages delivered. */
+struct Connection {
+	int fd;
+	char sent[LINE_SIZE];
+	int sentLength;
+	char received[LINE_SIZE];
+	int receivedLength;
+};
+
+/* A record of the capture with its time from the beginning, in microseconds. */
+struct Event {
+	struct CaptureRecord record;
+	unsigned long time;
+};
+
+struct SentEntry {
+	uint64_t hash;
+	long time;
+};
+struct SentEntry *sentTable;
+
+/* Latencies of the deliveries, in microseconds. */
+long *latencies;
+long numLatencies;
+long latenciesSize;
+
+long messagesSent;
+
+/* Capture connection ids are file descriptors of the recording server, so they are small:
+ * connections are indexed by them. */
+struct Connection **connections;
+unsigned long numConnections;
+
+long nowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a hash of a message text. */
+uint64_t hashText(char *text, int length) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < length; i++) {
+		hash ^= (unsigned char) text[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* The entry of the sent table for a hash: linear probing, overwriting a full table's oldest guess. */
+struct SentEntry *sentEntry(uint64_t hash) {
+	unsigned long index = hash & (SENT_TABLE_SIZE - 1);
+	for (int probe = 0; probe < 16; probe++) {
+		struct SentEntry *entry = &sentTable[(index + probe) & (SENT_TABLE_SIZE - 1)];
+		if (entry->hash == hash || entry->hash == 0) {
+			return entry;
+		}
+	}
+	return &sentTable[index];
+}
+
+void addLatency(long latency) {
+	if (numLatencies == latenciesSize) {
+		latenciesSize = latenciesSize == 0 ? 4096 : latenciesSize * 2;
+		latencies = realloc(latencies, latenciesSize * sizeof(*latencies));
+	}
+	latencies[numLatencies++] = latency;
+}
+
+/* A line was sent: if it's a text message remember when. */
+void lineSent(char *line, int length) {
+	if (length > 0 && line[length - 1] == '\r') {
+		length--;
+	}
+	if (length == 0 || line[0] == '\\') {
+		return;
+	}
+	uint64_t hash = hashText(line, length);
+	struct SentEntry *entry = sentEntry(hash);
+	entry->hash = hash;
+	entry->time = nowUs();
+	messagesSent++;
+}
+
+/* A line was received: if it's a channel message, "[seq] username> text", measure its latency. */
+void lineReceived(char *line, int length) {
+	if (length == 0 || line[0] != '[') {
+		return;
+	}
+	char *text = memchr(line, '>', length);
+	if (text == NULL || text + 1 >= line + length || text[1] != ' ') {
+		return;
+	}
+	text += 2;
+	uint64_t hash = hashText(text, line + length - text);
+	struct SentEntry *entry = sentEntry(hash);
+	if (entry->hash == hash) {
+		addLatency(nowUs() - entry->time);
+	}
+}
+
+/* Split data in lines, keeping the last partial one in buffer, and pass them to handle. */
+void splitLines(char *buffer, int *bufferLength, char *data, int length, void (*handle)(char *, int)) {
+	for (int i = 0; i < length; i++) {
+		if (data[i] == '\n') {
+			handle(buffer, *bufferLength);
+			*bufferLength = 0;
+		} else if (*bufferLength < LINE_SIZE) {
+			buffer[(*bufferLength)++] = data[i];
+		}
+	}
+}
+
+struct Connection *getConnection(unsigned long id) {
+	return id < numConnections ? connections[id] : NULL;
+}
+
+void replayConnect(int epollFD, unsigned long id, char *ip, int port) {
+	if (id >= numConnections) {
+		unsigned long size = numConnections == 0 ? 1024 : numConnections;
+		while (size <= id) {
+			size *= 2;
+		}
+		connections = realloc(connections, size * sizeof(*connections));
+		memset(connections + numConnections, 0, (size - numConnections) * sizeof(*connections));
+		numConnections = size;
+	}
+	struct Connection *conn = calloc(1, sizeof(*conn));
+	conn->fd = createClient();
+	connectToServer(conn->fd, ip, port);
+	connections[id] = conn;
+
+	struct epoll_event event = {0};
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	epoll_ctl(epollFD, EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+void replayClose(unsigned long id) {
+	struct Connection *conn = getConnection(id);
+	if (conn != NULL) {
+		close(conn->fd);
+		free(conn);
+		connections[id] = NULL;
+	}
+}
+
+void replayData(unsigned long id, char *data, int length) {
+	struct Connection *conn = getConnection(id);
+	if (conn == NULL) {
+		return;
+	}
+	splitLines(conn->sent, &conn->sentLength, data, length, lineSent);
+	int written = 0;
+	while (written < length) {
+		ssize_t n = send(conn->fd, data + written, length - written, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		written += n;
+	}
+}
+
+/* Read whatever the server delivered. Return the number of bytes received. */
+long receive(int epollFD, int timeout) {
+	struct epoll_event events[MAX_EVENTS];
+	int numEvents = epoll_wait(epollFD, events, MAX_EVENTS, timeout);
+	long total = 0;
+	for (int i = 0; i < numEvents; i++) {
+		struct Connection *conn = events[i].data.ptr;
+		char buffer[65536];
+		ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+		if (n <= 0) {
+			/* The server closed the connection: stop watching it, the capture will close it. */
+			epoll_ctl(epollFD, EPOLL_CTL_DEL, conn->fd, NULL);
+			continue;
+		}
+		total += n;
+		splitLines(conn->received, &conn->receivedLength, buffer, n, lineReceived);
+	}
+	return total;
+}
+
+int compareLong(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+	return (x > y) - (x < y);
+}
+
+long percentile(double p) {
+	if (numLatencies == 0) {
+		return 0;
+	}
+	long index = (long) (p * (numLatencies - 1));
+	return latencies[index];
+}
+
+void usage() {
+	fprintf(stderr,
+		"Usage: replay [-s speed] [-x server] [-p port] [-e] capture\n"
+		"  -s speed   replay speed, 2 is twice as fast as recorded, 0 as fast as possible (default 1)\n"
+		"  -x server  server executable to start (default ./server)\n"
+		"  -p port    port of the server (default %d)\n"
+		"  -e         replay against a server already running on port instead of starting one\n",
+		DEFAULT_PORT);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+	double speed = 1;
+	char *serverPath = "./server";
+	int port = DEFAULT_PORT;
+	int existing = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:x:p:e")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'x':
+			serverPath = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'e':
+			existing = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+	}
+
+	/* The whole capture is loaded first, so reading it doesn't disturb the timing. */
+	FILE *capture = captureOpen(argv[optind]);
+	if (capture == NULL) {
+		fprintf(stderr, "Cannot read the capture %s\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	struct Event *events = NULL;
+	long numEvents = 0, eventsSize = 0;
+	unsigned long elapsed = 0;
+	struct CaptureRecord record;
+	while (captureRead(capture, &record) == 0) {
+		if (numEvents == eventsSize) {
+			eventsSize = eventsSize == 0 ? 4096 : eventsSize * 2;
+			events = realloc(events, eventsSize * sizeof(*events));
+		}
+		elapsed += record.delta;
+		events[numEvents].record = record;
+		events[numEvents].time = elapsed;
+		numEvents++;
+	}
+	fclose(capture);
+
+	sentTable = calloc(SENT_TABLE_SIZE, sizeof(*sentTable));
+	pid_t serverPID = existing ? 0 : startServer(serverPath, port, NULL);
+	int epollFD = epoll_create1(0);
+
+	double serverCPUStart = existing ? 0 : processCPU(serverPID);
+	struct rusage usageStart, usageEnd;
+	getrusage(RUSAGE_SELF, &usageStart);
+	long start = nowUs();
+	long peakConnections = 0, openConnections = 0;
+
+	for (long i = 0; i < numEvents; i++) {
+		/* Wait for the time of the record, collecting deliveries meanwhile. */
+		if (speed > 0) {
+			long due = start + (long) (events[i].time / speed);
+			long wait;
+			while ((wait = due - nowUs()) > 0) {
+				receive(epollFD, wait >= 1000 ? wait / 1000 : 0);
+			}
+		}
+		receive(epollFD, 0);
+
+		struct CaptureRecord *r = &events[i].record;
+		if (r->type == CAPTURE_CONNECT) {
+			replayConnect(epollFD, r->connection, "127.0.0.1", port);
+			if (++openConnections > peakConnections) {
+				peakConnections = openConnections;
+			}
+		} else if (r->type == CAPTURE_DATA) {
+			replayData(r->connection, r->data, r->length);
+		} else if (r->type == CAPTURE_CLOSE) {
+			if (getConnection(r->connection) != NULL) {
+				openConnections--;
+			}
+			replayClose(r->connection);
+		}
+	}
+
+	/* Collect the last deliveries. */
+	long replayEnd = nowUs();
+	long lastData = replayEnd;
+	while (nowUs() - lastData < DRAIN_IDLE_MS * 1000 && nowUs() - replayEnd < DRAIN_MAX_MS * 1000) {
+		if (receive(epollFD, 100) > 0) {
+			lastData = nowUs();
+		}
+	}
+	long end = nowUs();
+
+	getrusage(RUSAGE_SELF, &usageEnd);
+	double serverCPU = existing ? 0 : processCPU(serverPID) - serverCPUStart;
+	double replayCPU = (usageEnd.ru_utime.tv_sec - usageStart.ru_utime.tv_sec)
+		+ (usageEnd.ru_stime.tv_sec - usageStart.ru_stime.tv_sec)
+		+ ((usageEnd.ru_utime.tv_usec - usageStart.ru_utime.tv_usec)
+		+ (usageEnd.ru_stime.tv_usec - usageStart.ru_stime.tv_usec)) / 1e6;
+	if (!existing) {
+		stopServer(serverPID);
+	}
+
+	qsort(latencies, numLatencies, sizeof(*latencies), compareLong);
+	double replaySeconds = (replayEnd - start) / 1e6;
+	printf("records:     %ld replayed in %.3f s (speed %gx), peak %ld connections\n",
+		numEvents, replaySeconds, speed, peakConnections);
+	printf("messages:    %ld sent, %ld delivered (%.0f deliveries/s)\n",
+		messagesSent, numLatencies, numLatencies / ((end - start) / 1e6));
+	printf("latency us:  p50 %ld  p90 %ld  p99 %ld  p99.9 %ld  max %ld\n",
+		percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), percentile(1));
+	if (!existing) {
+		printf("server cpu:  %.3f s (%.1f%% of the replay)\n", serverCPU, 100 * serverCPU / ((end - start) / 1e6));
+	}
+	printf("replay cpu:  %.3f s\n", replayCPU);
+	return 0;
+}
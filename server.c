@@ -16,231 +16,1265 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "affinity.h"
+#include "capture.h"
+#include "cursor.h"
+#include "filter.h"
+#include "spam.h"
+#include "topk.h"
+#include "chat.h"
+#include "probes.h"
 #include "socketlib.h"
 
-#define MAX_CLIENTS 1000
-#define MAX_CHANNELS 100
-#define PORT 50001
-
-/* For each client we keep information about the username, the position in the file descriptor set and the cannel.
- * Moreover there are pointers to next and previous clients in the chat and in the same channel. */
-struct Client {
-	char* username;
-	int fdsIndex;
-	struct Client* nextInChat;
-	struct Client* prevInChat;
-	struct Client* nextInChannel;
-	struct Client* prevInChannel;
-	struct Channel* channel;
-};
-struct Client* chatHead;
-struct Client* chatTail;
-
-/* A container from which a given client can be found: the key is actually the
- * client's username. */
-struct ClientBucket {
-	char* key;
-	struct Client* value;
-	struct ClientBucket* nextInChat;
-};
-struct ClientBucket *clientHashtable[MAX_CLIENTS];
+#define DEFAULT_PORT 50001
+/* How many of the last messages of a channel are kept to fill the gaps of reconnecting clients
+ * that don't acknowledge what they receive. Messages not acknowledged by the clients that do
+ * are kept until they are, up to HISTORY_MAX messages. */
+#define HISTORY_SIZE 256
+#define HISTORY_MAX 16384
+/* A disconnected client keeps its session, that is username, channel and pending output,
+ * for this many seconds: reconnecting with the session token restores it. */
+#define SESSION_GRACE_SECONDS 60
+/* At most this many sessions are kept detached: beyond it the oldest is released. */
+#define DETACHED_MAX MAX_CLIENTS
+/* The output queued for a disconnected client is capped: beyond this the oldest messages
+ * are dropped, the client can still get them from the channel history. */
+#define SESSION_QUEUE_MAX (64 * 1024)
+/* A connected client with more output than this waiting doesn't keep up: its connection
+ * is closed, keeping the session. */
+#define OUTPUT_QUEUE_MAX (1024 * 1024)
+/* Session tokens are 16 random bytes in hexadecimal. */
+#define TOKEN_LENGTH 32
+/* Messages written to a client with a single system call at most. */
+#define FLUSH_BATCH 64
+/* Control messages overtake at most this many of them in a row the channel messages waiting,
+ * then one channel message is let through, so neither kind starves the other. */
+#define CONTROL_BYPASS_MAX 16
+/* With preallocation (-P) the output queues get room for this many messages per client. */
+#define PREALLOCATED_OUTPUT 16
+/* Below this many microseconds busy polling is not worth it, see waitForEvents(). */
+#define SPIN_MIN_US 4
+/* Message ids remembered per client: a message sent again with one of them is dropped. */
+#define DEDUPE_WINDOW 64
+/* Entries listed by \top for every kind of heavy hitter. */
+#define TOP_LISTED 10
+/* Channels listed by \unread at most. */
+#define UNREAD_MAX 64
+/* Per iteration a client is read once, INPUT_SIZE bytes at most, and this many of its lines are
+ * processed at most: the rest waits for its next turn in the ready queue. */
+#define READ_BUDGET_LINES 16
+/* Fan-out: at every turn an active channel may queue this many copies of its messages, and the
+ * turns of an iteration end after FANOUT_BUDGET_US microseconds. See fanOut(). */
+#define FANOUT_QUANTUM 256
+#define FANOUT_BUDGET_US 1000
 
-struct Channel {
-	char *name;
-	struct Channel *nextInChat;
-	struct Client* head;
-	struct Client* tail;
-};
+/* When not NULL, everything received from the clients is recorded here (see capture.h). */
+FILE* capture;
+
+/* When set, connections are accepted only within the limits per address and per subnet and the
+ * rules of admissionPath (see admission.h). */
+int admission;
+
+/* When not NULL, messages matching any of the patterns in filterPath are not broadcast (see filter.h). */
+struct Filter* filter;
+char* filterPath;
 
-/* A container from which a given channel can be found: the key is actually the
- * channel's name. */
-struct ChannelBucket {
-	char* key;
-	struct Channel* value;
-	struct ChannelBucket* nextInChat;
+/* When not 0, messages seen more than this many times in the last SPAM_WINDOW seconds, in any
+ * channel, are not broadcast (see spam.h). */
+int spamThreshold;
+
+/* When bufferMax is not 0 the socket buffers of every client are sized from its traffic, between
+ * bufferMin and bufferMax bytes, every BUFFER_PERIOD seconds: a buffer holds BUFFER_MS milliseconds
+ * of what is expected to go through it. See sizeBuffers(). */
+#define BUFFER_PERIOD 1
+#define BUFFER_MS 100
+int bufferMin;
+int bufferMax;
+time_t buffersSizedAt;
+/* The sizes of the send and receive buffers of all the sockets as the kernel reports them, that is
+ * the kernel memory they may take, answered by \buffers. */
+long sendBuffersTotal;
+long receiveBuffersTotal;
+
+/* What drives the load: the clients and the channels with the most messages, bytes and bytes
+ * times members (the cost of the fan-out), answered by \top. */
+struct TopK heavyHitters[] = {
+	{ .name = "client-messages" },
+	{ .name = "client-bytes" },
+	{ .name = "client-cost" },
+	{ .name = "channel-messages" },
+	{ .name = "channel-bytes" },
+	{ .name = "channel-cost" },
 };
-struct ChannelBucket *channelHashtable[MAX_CHANNELS];
 
-/* Simple hash evaluation for a string as in section 6.6 of 'The C Programming Language' */
-int hash(char* s, int size) {
-	int hashValue;
-	for (hashValue = 0; *s != '\0'; s++) {
-		hashValue = *s + 31 * hashValue % size;
+long monotonicUs() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+int socketBuffer(int fd, int option) {
+	int size = 0;
+	socklen_t length = sizeof(size);
+	getsockopt(fd, SOL_SOCKET, option, &size, &length);
+	return size;
+}
+
+/* Close the connection of a client. */
+void closeConnection(int fd) {
+	if (capture != NULL) {
+		captureWrite(capture, CAPTURE_CLOSE, fd, NULL, 0);
+	}
+	if (admission) {
+		admissionRelease(fd);
+	}
+	if (bufferMax > 0) {
+		sendBuffersTotal -= socketBuffer(fd, SO_SNDBUF);
+		receiveBuffersTotal -= socketBuffer(fd, SO_RCVBUF);
 	}
-	return hashValue;
+	close(fd);
 }
 
-/* Remove a client's bucket from the hashtable collection by the key (client's username).
- * The removal is inspired by Linus Torvalds linked list argument where we take
- * advantage of using the undirect pointer b to avoid handling the special case
- * for removing the head. */
-void deleteClientByUsername(char* username) {
-	struct ClientBucket **b = &clientHashtable[hash(username, MAX_CLIENTS)];
-	while (*b != NULL && strcmp((*b)->key, username) != 0) {
-		b = &(*b)->nextInChat;
+/* A channel created after a restart continues the numbering of the cursors kept in the journal. */
+unsigned long channelStart(char* name) {
+	int id = cursorFind(CURSOR_CHANNEL, name);
+	return id == -1 ? 0 : cursorLast(id);
+}
+
+/* Release the message at the head of the output queue of a client, once written or when dropped.
+ * A message partially written may be dropped only from clients without a connection. */
+void releaseOutputHead(struct Client* client) {
+	struct OutputEntry* entry = client->outputHead;
+	client->outputHead = entry->next;
+	if (client->outputHead == NULL) {
+		client->outputTail = NULL;
 	}
-	if (*b != NULL) {
-		*b = (*b)->nextInChat;
+	if (entry == client->controlTail) {
+		client->controlTail = NULL;
+		client->bypassed = 0;
 	}
+	client->outputOffset = 0;
+	client->outputBytes -= entry->message->length;
+	releaseMessage(entry->message);
+	poolFree(&entryPool, entry);
 }
 
-/* Insert a pair username-client in clientHashtable.
- * There is the same reasoning for the undirect pointer b as in deleteClientByUsername. */
-void insertClient(char* username, struct Client* c) {
-	struct ClientBucket **b = &clientHashtable[hash(username, MAX_CLIENTS)];
-	while (*b != NULL) {
-		b = &(*b)->nextInChat;
+/* Write as much queued output as the socket of a client accepts, gathering up to FLUSH_BATCH
+ * messages in each system call. If some is left we ask poll() to tell us when the socket is
+ * writable again. */
+void flushClient(struct Client* client) {
+	if (client->detached) {
+		return;
+	}
+	struct pollfd* pfd = &fds[client->fdsIndex];
+	while (client->outputHead != NULL) {
+		struct iovec iov[FLUSH_BATCH];
+		int count = 0;
+		int offset = client->outputOffset;
+		for (struct OutputEntry* e = client->outputHead; e != NULL && count < FLUSH_BATCH; e = e->next) {
+			iov[count].iov_base = e->message->data + offset;
+			iov[count].iov_len = e->message->length - offset;
+			offset = 0;
+			count++;
+		}
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t n = sendmsg(pfd->fd, &msg, MSG_NOSIGNAL);
+		if (n == -1) {
+			/* Unless the socket is just full, the error is reported by poll() as well and
+			 * handled as a disconnection. */
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		client->sentBytes += n;
+		/* Release the messages written completely. */
+		while (n > 0) {
+			struct Message* message = client->outputHead->message;
+			int left = message->length - client->outputOffset;
+			if (n < left) {
+				client->outputOffset += n;
+				break;
+			}
+			n -= left;
+			releaseOutputHead(client);
+		}
 	}
+	if (client->outputHead != NULL) {
+		pfd->events |= POLLOUT;
+	} else {
+		pfd->events &= ~POLLOUT;
+	}
+}
 
-	struct ClientBucket* newBucket;
-	newBucket = malloc(sizeof(newBucket));
-	newBucket->key = strdup(username);
-	newBucket->value = c;
-	*b = newBucket;
+/* Write the output queued during the current iteration. Writing it at the end rather than
+ * message by message takes a single system call and, on the wire, as few segments as possible
+ * for everything a client gets in an iteration. Clients waiting for POLLOUT are left to poll(). */
+void flushAll() {
+	for (int i = 1; i <= numClients; i++) {
+		if (outputPending[i]) {
+			outputPending[i] = 0;
+			if (!(fds[i].events & POLLOUT)) {
+				flushClient(connected[i]);
+			}
+		}
+	}
 }
 
-/* Insert a pair name-channel in channelHashtable.
- * There is the same reasoning for the undirect pointer b as in deleteClientByUsername. */
-void insertChannel(char* name, struct Channel* c) {
-	struct ChannelBucket **b = &channelHashtable[hash(name, MAX_CHANNELS)];
-	while (*b != NULL) {
-		b = &(*b)->nextInChat;
+/* Append a message to the output queue of a client, written by flushAll() at the end of the iteration.
+ * A detached client keeps at most SESSION_QUEUE_MAX bytes, the oldest ones are dropped;
+ * if it acknowledges messages, channel messages are not queued at all. */
+void queueMessage(struct Client* client, struct Message* message) {
+	if (client->detached && client->acking && message->seq != 0) {
+		/* The history keeps it until the client acknowledges it, it's sent on resume. */
+		return;
 	}
+	struct OutputEntry* entry = poolAlloc(&entryPool);
+	entry->message = message;
+	message->refcount++;
+	client->outputBytes += message->length;
 
-	struct ChannelBucket* newBucket;
-	newBucket = malloc(sizeof(newBucket));
-	newBucket->key = strdup(name);
-	newBucket->value = c;
-	*b = newBucket;
+	/* Control messages go after the ones queued before them and after the message being written,
+	 * ahead of the channel messages: after CONTROL_BYPASS_MAX of them one channel message goes first. */
+	struct OutputEntry* after = client->controlTail;
+	if (after == NULL && client->outputOffset > 0) {
+		after = client->outputHead;
+	}
+	struct OutputEntry* next = after == NULL ? client->outputHead : after->next;
+	if (message->seq == 0) {
+		if (next != NULL && client->bypassed == CONTROL_BYPASS_MAX) {
+			after = next;
+			next = next->next;
+			client->bypassed = 0;
+		}
+		if (after == NULL) {
+			client->outputHead = entry;
+		} else {
+			after->next = entry;
+		}
+		entry->next = next;
+		if (next == NULL) {
+			client->outputTail = entry;
+		} else {
+			client->bypassed++;
+		}
+		client->controlTail = entry;
+	} else {
+		entry->next = NULL;
+		if (client->outputTail == NULL) {
+			client->outputHead = entry;
+		} else {
+			client->outputTail->next = entry;
+		}
+		client->outputTail = entry;
+	}
+
+	if (client->detached) {
+		while (client->outputBytes > SESSION_QUEUE_MAX) {
+			releaseOutputHead(client);
+		}
+		return;
+	}
+	outputPending[client->fdsIndex] = 1;
+	if (client->outputBytes > OUTPUT_QUEUE_MAX) {
+		/* Detaching here could invalidate the lists being scanned by the caller. */
+		if (!client->overflowed) {
+			client->overflowed = 1;
+			client->nextOverflowed = overflowedHead;
+			overflowedHead = client;
+		}
+		return;
+	}
 }
 
-/* Find the client, if present, contained in the bucket whose key is username. */
-struct Client* getClientByUsername(char* username) {
-	int hashValue = hash(username, MAX_CLIENTS);
-	struct ClientBucket* curr = clientHashtable[hashValue];
-	while (curr != NULL) {
-		if (strcmp(curr->key, username) == 0) {
-			/* Client found */
-			return curr->value;
+/* Send to a client a reply built from a printf-like format. */
+void reply(struct Client* client, char* format, ...) {
+	char text[INPUT_SIZE * 2];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	struct Message* message = createMessage("%s", text);
+	queueMessage(client, message);
+	releaseMessage(message);
+}
+
+/* Move the history of a channel into a ring of the given capacity. */
+void resizeHistory(struct Channel* channel, unsigned long capacity) {
+	struct Message** history = calloc(capacity, sizeof(*history));
+	for (unsigned long s = channel->firstSeq; s <= channel->lastSeq; s++) {
+		history[s % capacity] = channel->history[s % channel->historyCapacity];
+	}
+	free(channel->history);
+	channel->history = history;
+	channel->historyCapacity = capacity;
+}
+
+/* Queue the oldest message of a channel not fanned out yet to the members that don't have it:
+ * not the sender, nor the ones that joined after it was broadcast, acknowledged it already or got
+ * it from history. */
+void fanOutNext(struct Channel* channel) {
+	struct Message* message = channel->history[++channel->fannedSeq % channel->historyCapacity];
+	PROBE2(broadcast__start, channel->name, message->seq);
+	int fanout = 0;
+	for (int i = 0; i < channel->numMembers; i++) {
+		struct Client* c = channel->members[i];
+		if (c != message->sender && message->seq > c->ackedSeq && message->seq > c->historySeq) {
+			queueMessage(c, message);
+			fanout++;
+		}
+	}
+	PROBE2(broadcast__done, channel->name, fanout);
+}
+
+/* Append a message to the history of its channel, which takes over the reference.
+ * Once HISTORY_MAX messages are kept the oldest one is released, fanned out first if needed. */
+void appendHistory(struct Channel* channel, struct Message* message) {
+	unsigned long count = channel->lastSeq - channel->firstSeq + 1;
+	if (count == channel->historyCapacity) {
+		if (channel->historyCapacity < HISTORY_MAX) {
+			resizeHistory(channel, channel->historyCapacity == 0 ? 16 : channel->historyCapacity * 2);
 		} else {
-			curr = curr->nextInChat;
+			if (channel->fannedSeq < channel->firstSeq) {
+				fanOutNext(channel);
+			}
+			unsigned long index = channel->firstSeq++ % channel->historyCapacity;
+			releaseMessage(channel->history[index]);
+			channel->history[index] = NULL;
+		}
+	}
+	channel->lastSeq = message->seq;
+	channel->history[message->seq % channel->historyCapacity] = message;
+	if (count >= HISTORY_SIZE) {
+		markDirty(channel);
+	}
+}
+
+/* Release the messages of the history no member of the channel may ask again: the ones acknowledged
+ * by every member that acknowledges and, for the others, the ones older than the last HISTORY_SIZE.
+ * Messages not fanned out yet stay. Members are scanned once per iteration at most, not on every
+ * acknowledgement. */
+void trimHistory(struct Channel* channel) {
+	unsigned long floor = channel->fannedSeq;
+	unsigned long window = channel->lastSeq > HISTORY_SIZE ? channel->lastSeq - HISTORY_SIZE : 0;
+	for (int i = 0; i < channel->numMembers; i++) {
+		struct Client* c = channel->members[i];
+		unsigned long retained = c->acking ? c->ackedSeq : window;
+		if (retained < floor) {
+			floor = retained;
 		}
 	}
-	/* No client with that username has been found. */
-	return NULL;
+	while (channel->firstSeq <= floor) {
+		unsigned long index = channel->firstSeq++ % channel->historyCapacity;
+		releaseMessage(channel->history[index]);
+		channel->history[index] = NULL;
+	}
+
+	/* Give memory back when the ring is mostly empty. */
+	unsigned long count = channel->lastSeq - channel->firstSeq + 1;
+	unsigned long capacity = channel->historyCapacity;
+	while (capacity > 16 && count < capacity / 4) {
+		capacity /= 2;
+	}
+	if (capacity != channel->historyCapacity) {
+		resizeHistory(channel, capacity);
+	}
+}
+
+/* Trim the history of the channels that changed during the current iteration. */
+void trimDirtyChannels() {
+	while (dirtyHead != NULL) {
+		struct Channel* channel = dirtyHead;
+		dirtyHead = channel->nextDirty;
+		channel->dirty = 0;
+		trimHistory(channel);
+	}
 }
 
-/* Find the channel, if present, contained in the bucket whose key is name. */
-struct Channel* getChannelByName(char* name) {
-	int hashValue = hash(name, MAX_CHANNELS);
-	struct ChannelBucket* curr = channelHashtable[hashValue];
-	while (curr != NULL) {
-		if (strcmp(curr->key, name) == 0) {
-			/* Channel found */
-			return curr->value;
+/* Whether a message must not be broadcast: it contains a banned pattern, or it's one more copy
+ * of a text posted too many times lately. Copies are counted even when they are rejected. */
+int rejected(char* text) {
+	if (filter != NULL && filterMatch(filter, text, strlen(text))) {
+		return 1;
+	}
+	unsigned long fingerprint;
+	return spamThreshold > 0 && (fingerprint = spamFingerprint(text)) != 0
+		&& spamCount(fingerprint, time(NULL)) > spamThreshold;
+}
+
+/* Broadcast a text message of a client to the other clients of its channel, unless it's
+ * rejected: the client is told with a \filtered notice. The message is numbered with the next
+ * sequence number of the channel and stored in its history; it is queued to the members later,
+ * when the channel gets its turn in fanOut(). */
+void broadcast(struct Client* client, char* text) {
+	if (rejected(text)) {
+		reply(client, "\\filtered\n");
+		return;
+	}
+	struct Channel* channel = client->channel;
+	struct Message* message = createMessage("[%lu] %s> %s\n", channel->lastSeq + 1, client->session->username, text);
+	message->seq = channel->lastSeq + 1;
+	message->sender = client;
+
+	time_t now = time(NULL);
+	unsigned long cost = (unsigned long) message->length * channel->numMembers;
+	channel->broadcastBytes += message->length;
+	topkAdd(&heavyHitters[0], client->session->username, 1, now);
+	topkAdd(&heavyHitters[1], client->session->username, message->length, now);
+	topkAdd(&heavyHitters[2], client->session->username, cost, now);
+	topkAdd(&heavyHitters[3], channel->name, 1, now);
+	topkAdd(&heavyHitters[4], channel->name, message->length, now);
+	topkAdd(&heavyHitters[5], channel->name, cost, now);
+
+	/* The history takes over our reference. */
+	appendHistory(channel, message);
+	markActive(channel);
+}
+
+/* Fan out the messages of the active channels, taking turns in deficit round robin: at every turn
+ * a channel earns FANOUT_QUANTUM copies and fans out its messages, in order, while it can pay one copy
+ * per member for them. A flooded channel thus gets the same share of the iteration as a quiet one
+ * and only its own messages wait. The turns stop after FANOUT_BUDGET_US: what is left is fanned out
+ * in the next iteration, which doesn't wait for events meanwhile. */
+void fanOut() {
+	long deadline = monotonicUs() + FANOUT_BUDGET_US;
+	while (activeHead != NULL) {
+		struct Channel* channel = activeHead;
+		activeHead = channel->nextActive;
+		if (activeHead == NULL) {
+			activeTail = NULL;
+		}
+		channel->active = 0;
+		int cost = channel->numMembers > 0 ? channel->numMembers : 1;
+		channel->deficit += FANOUT_QUANTUM;
+		while (channel->fannedSeq < channel->lastSeq && channel->deficit >= cost) {
+			fanOutNext(channel);
+			channel->deficit -= cost;
+		}
+		if (channel->fannedSeq < channel->lastSeq) {
+			markActive(channel);
 		} else {
-			curr = curr->nextInChat;
-		}
-	}
-	/* No client with that username has been found. */
-	return NULL;
-}
-
-/* The set of file descriptors used to check incoming data: one for the server plus one for each client */
-struct pollfd fds[MAX_CLIENTS + 1];
-
-/* The number of connected clients: it's useful to specify how many items are in the fds array in poll(). */
-int numClients = 0;
-
-/* Discard all info about a client by releasing and overwriting the related resources.
- * As side effect we update the fds entries and if necessary also head and tail for the chat and the channel. */
-void freeClient(struct Client* client) {
-	close(fds[client->fdsIndex].fd);
-	free(client->username);
-
-	/* chatTail client will occupy the entry in fds where the currently deleting client was at. 
-	 * To do it we overwrite the client data in its fds entry with the chatTail data and invalidate the
-	 * data present at chatTail index. */
-	fds[client->fdsIndex].fd = fds[chatTail->fdsIndex].fd;
-	fds[chatTail->fdsIndex].fd = -1;
-	fds[chatTail->fdsIndex].events = 0;
-	int revents = fds[chatTail->fdsIndex].revents;
-	fds[chatTail->fdsIndex].revents = 0;
-	chatTail->fdsIndex = client->fdsIndex;
-	/* Ignore the returned events of chatTail only if it is the client removed, 
-	 * otherwise restore that info for chatTail. */
-	fds[chatTail->fdsIndex].revents = chatTail == client ? 0 : revents;
-
-	/* The client that might be the new tail. */
-	struct Client *prevTail = chatTail->prevInChat;
-
-	/* Update chatTail next pointer and client next prev paying attention if: 
-	 * 1. we remove chatTail (NULL reference)
-	 * 2. we remove the client before chatTail (we may create a loop) */
-	if (client != chatTail && client != prevTail) {
-		chatTail->nextInChat = client->nextInChat;
-		client->nextInChat->prevInChat = chatTail;
-	}
-	chatTail->prevInChat = client->prevInChat;
-	if (client == chatHead) {
-		/* If chatHead is being removed update chatHead with chatTail only if there is at least another client. */
-		chatHead = chatHead == chatTail ? NULL : chatTail;
-	} else {
-		/* For any other client just update the next pointer of its previous. */
-		client->prevInChat->nextInChat = chatTail;
+			/* Credit is not saved up while idle. */
+			channel->deficit = 0;
+		}
+		if (monotonicUs() >= deadline) {
+			break;
+		}
+	}
+}
+
+/* Whether a client sent a message with this id among its last DEDUPE_WINDOW ones, otherwise
+ * the id is remembered. Ids are kept as 64-bit FNV-1a hashes, 0 marks an empty slot. */
+int isDuplicate(struct Client* client, char* id) {
+	unsigned long h = 14695981039346656037UL;
+	for (char* c = id; *c != '\0'; c++) {
+		h = (h ^ (unsigned char) *c) * 1099511628211UL;
 	}
-	/* We update chatTail to prevTail only if we're not deleting prevTail, otherwise chatTail is unchanged. */
-	if (prevTail != client) {
-		chatTail = prevTail;
-		if (chatTail != NULL) {
-			chatTail->nextInChat = NULL;
+	h |= 1;
+	struct Session* session = client->session;
+	if (session->recentIds == NULL) {
+		session->recentIds = calloc(DEDUPE_WINDOW, sizeof(*session->recentIds));
+	}
+	for (int i = 0; i < DEDUPE_WINDOW; i++) {
+		if (session->recentIds[i] == h) {
+			return 1;
 		}
 	}
+	session->recentIds[session->recentIdsNext] = h;
+	session->recentIdsNext = (session->recentIdsNext + 1) % DEDUPE_WINDOW;
+	return 0;
+}
+
+/* Send to a client the messages of its channel following seq that are still in history,
+ * skipping the ones already sent again on this connection.
+ * A seq greater than the last one of the channel comes from a previous run of the server:
+ * in that case everything in history is sent. */
+void sendHistory(struct Client* client, unsigned long seq) {
+	struct Channel* channel = client->channel;
+	if (channel == NULL) {
+		return;
+	}
+	if (seq > channel->lastSeq) {
+		seq = 0;
+	}
+	if (seq < client->historySeq) {
+		seq = client->historySeq;
+	}
+	unsigned long first = seq + 1 > channel->firstSeq ? seq + 1 : channel->firstSeq;
+	for (unsigned long s = first; s <= channel->lastSeq; s++) {
+		queueMessage(client, channel->history[s % channel->historyCapacity]);
+	}
+	client->historySeq = channel->lastSeq;
+}
+
+/* Drop from the output queue of a client the channel messages up to seq. A message partially
+ * written to the connection stays, the rest of it must follow. */
+void trimOutput(struct Client* client, unsigned long seq) {
+	struct OutputEntry** e = &client->outputHead;
+	struct OutputEntry* last = NULL;
+	if (*e != NULL && client->outputOffset > 0) {
+		last = *e;
+		e = &(*e)->next;
+	}
+	while (*e != NULL) {
+		struct OutputEntry* entry = *e;
+		if (entry->message->seq != 0 && entry->message->seq <= seq) {
+			*e = entry->next;
+			client->outputBytes -= entry->message->length;
+			releaseMessage(entry->message);
+			poolFree(&entryPool, entry);
+		} else {
+			last = entry;
+			e = &entry->next;
+		}
+	}
+	client->outputTail = last;
+}
+
+/* Move the cursor of a client in its channel to the last message acknowledged or, if it doesn't
+ * acknowledge, to the last one queued to it. */
+void saveCursor(struct Client* client) {
+	if (client->session->named && client->channel != NULL) {
+		unsigned long seq = client->acking ? client->ackedSeq : client->channel->fannedSeq;
+		cursorSet(cursorId(CURSOR_USER, client->session->username), cursorId(CURSOR_CHANNEL, client->channel->name), seq);
+	}
+}
 
+/* The client acknowledged every message of its channel up to seq: what is queued up to it
+ * is not needed anymore and the history may be trimmed. */
+void acknowledge(struct Client* client, unsigned long seq) {
 	struct Channel* channel = client->channel;
-	struct Client* channelHead = channel->head;
-	struct Client* channelTail = channel->tail;
-	/* The client that might be the new channel tail. */
-	prevTail = channelTail->prevInChannel;
-
-	/* Update channelTail next pointer and client next prev paying attention if: 
-	 * 1. we remove channelTail (NULL reference)
-	 * 2. we remove the client before channelTail (we may create a loop) */
-	if (client != channelTail && client != prevTail) {
-		channelTail->nextInChannel = client->nextInChannel;
-		client->nextInChannel->prevInChannel = channelTail;
-	}
-	channelTail->prevInChannel = client->prevInChannel;
-	if (client == channelHead) {
-		/* If channel head is being removed update channel head with channelTail only if there is at least another client. */
-		channel->head = channelHead == channelTail ? NULL : channelTail;
+	if (channel == NULL || seq > channel->lastSeq) {
+		return;
+	}
+	client->acking = 1;
+	if (seq > client->ackedSeq) {
+		client->ackedSeq = seq;
+		trimOutput(client, seq);
+		markDirty(channel);
+		saveCursor(client);
+	}
+}
+
+/* Tell a client how many messages follow its cursor in every channel it has one in:
+ * "\unread <channel> <count> ...". Channels not seen since a restart count up to the journal. */
+void sendUnread(struct Client* client) {
+	char text[INPUT_SIZE * 2];
+	int length = snprintf(text, sizeof(text), "\\unread");
+	saveCursor(client);
+	if (client->channel != NULL && client->channel->fannedSeq == 0) {
+		/* Nothing was sent in the current channel yet, so there is no cursor to list. */
+		length += snprintf(text + length, sizeof(text) - length, " %.*s 0", INPUT_SIZE, client->channel->name);
+	}
+	int user = client->session->named ? cursorFind(CURSOR_USER, client->session->username) : -1;
+	if (user != -1) {
+		int ids[UNREAD_MAX];
+		unsigned long seqs[UNREAD_MAX];
+		int count = cursorList(user, ids, seqs, UNREAD_MAX);
+		for (int i = 0; i < count; i++) {
+			char* name = cursorName(CURSOR_CHANNEL, ids[i]);
+			struct Channel* channel = getChannelByName(name);
+			unsigned long last = channel != NULL ? channel->lastSeq : cursorLast(ids[i]);
+			int added = snprintf(text + length, sizeof(text) - length, " %s %lu", name, last > seqs[i] ? last - seqs[i] : 0);
+			if (added >= (int) sizeof(text) - length - 1) {
+				break;
+			}
+			length += added;
+		}
+	}
+	reply(client, "%s\n", text);
+}
+
+/* Send to a client the heavy hitters, a line for every kind: "\top <kind> <key> <count> ...". */
+void sendTop(struct Client* client) {
+	time_t now = time(NULL);
+	for (unsigned long k = 0; k < sizeof(heavyHitters) / sizeof(heavyHitters[0]); k++) {
+		struct TopKEntry* entries[TOP_LISTED];
+		int count = topkList(&heavyHitters[k], entries, TOP_LISTED, now);
+		char text[INPUT_SIZE];
+		int length = snprintf(text, sizeof(text), "\\top %s", heavyHitters[k].name);
+		for (int i = 0; i < count; i++) {
+			length += snprintf(text + length, sizeof(text) - length, " %s %lu", entries[i]->key, entries[i]->count);
+		}
+		reply(client, "%s\n", text);
+	}
+}
+
+/* Set one of the buffers of a socket, keeping total up to date: the buffer counts from the first
+ * time it's set. The kernel doubles the size asked for, to account for its bookkeeping, and caps it
+ * to net.core.wmem_max or rmem_max. */
+void setSocketBuffer(int fd, int option, int size, int counted, long* total) {
+	if (counted) {
+		*total -= socketBuffer(fd, option);
+	}
+	setsockopt(fd, SOL_SOCKET, option, &size, sizeof(size));
+	*total += socketBuffer(fd, option);
+}
+
+/* The buffer size holding BUFFER_MS milliseconds of traffic at rate bytes per second: bufferMin
+ * doubled as many times as needed, up to bufferMax. Sizes changing by powers of two, a buffer is
+ * only set again when its traffic changes by half or twice. */
+int bufferFor(unsigned long rate) {
+	unsigned long wanted = rate * BUFFER_MS / 1000;
+	int size = bufferMin;
+	while (size < bufferMax && (unsigned long) size < wanted) {
+		size *= 2;
+	}
+	return size < bufferMax ? size : bufferMax;
+}
+
+/* Size the socket buffers of a client. The send buffer is for the larger of the rate at which the
+ * client was sent data and the rate of its channel, which it's due to receive, so that joining
+ * a busy channel is enough for a large one; the receive buffer is for the rate it sent data. */
+void sizeBuffers(struct Client* client) {
+	int fd = fds[client->fdsIndex].fd;
+	struct Session* session = client->session;
+	unsigned long expected = session->sendRate;
+	if (client->channel != NULL && client->channel->broadcastRate > expected) {
+		expected = client->channel->broadcastRate;
+	}
+	int size = bufferFor(expected);
+	if (size != session->sendBuffer) {
+		setSocketBuffer(fd, SO_SNDBUF, size, session->sendBuffer != 0, &sendBuffersTotal);
+		session->sendBuffer = size;
+	}
+	size = bufferFor(session->receiveRate);
+	if (size != session->receiveBuffer) {
+		setSocketBuffer(fd, SO_RCVBUF, size, session->receiveBuffer != 0, &receiveBuffersTotal);
+		session->receiveBuffer = size;
+	}
+}
+
+/* Every BUFFER_PERIOD seconds update the rates of the channels and of the connected clients, then
+ * size the buffers of the clients. The rates are averaged with the previous ones, so a quiet second
+ * doesn't shrink the buffers of a busy client at once. */
+void sizeAllBuffers() {
+	time_t now = time(NULL);
+	if (now - buffersSizedAt < BUFFER_PERIOD) {
+		return;
+	}
+	unsigned long elapsed = now - buffersSizedAt;
+	buffersSizedAt = now;
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		for (struct ChannelBucket* b = channelHashtable[i]; b != NULL; b = b->nextInChat) {
+			struct Channel* channel = b->value;
+			channel->broadcastRate = (channel->broadcastRate + channel->broadcastBytes / elapsed) / 2;
+			channel->broadcastBytes = 0;
+		}
+	}
+	for (int i = 1; i <= numClients; i++) {
+		struct Client* client = connected[i];
+		struct Session* session = client->session;
+		session->sendRate = (session->sendRate + client->sentBytes / elapsed) / 2;
+		session->receiveRate = (session->receiveRate + client->receivedBytes / elapsed) / 2;
+		client->sentBytes = 0;
+		client->receivedBytes = 0;
+		sizeBuffers(client);
+	}
+}
+
+/* Identifies this run of the server, so that clients can tell a restart from a reconnect. */
+char serverID[32];
+
+/* Random bytes for session tokens. */
+int randomFD = -1;
+
+/* Give a client a new session token and tell it to the client. */
+void createSession(struct Client* client) {
+	unsigned char bytes[TOKEN_LENGTH / 2];
+	if (read(randomFD, bytes, sizeof(bytes)) != sizeof(bytes)) {
+		perror("Session token error");
+		exit(EXIT_FAILURE);
+	}
+	client->session->token = malloc(TOKEN_LENGTH + 1);
+	for (int i = 0; i < TOKEN_LENGTH / 2; i++) {
+		snprintf(client->session->token + 2 * i, 3, "%02x", bytes[i]);
+	}
+	insertSession(client->session->token, client);
+	reply(client, "\\session %s\n", client->session->token);
+}
+
+/* The connection of a client has been lost: close it but keep the session, that is username,
+ * channel and output, for SESSION_GRACE_SECONDS in case the client comes back. A client that
+ * never chose a username nor joined a channel has nothing worth resuming and is released. */
+void detachClient(struct Client* client) {
+	if (!client->session->named && client->channel == NULL) {
+		freeClient(client);
+		return;
+	}
+	PROBE2(client__detach, fds[client->fdsIndex].fd, client->session->username);
+	saveCursor(client);
+	closeConnection(fds[client->fdsIndex].fd);
+	removeFromChat(client);
+	releaseInput(client);
+	if (client->ready) {
+		removeFromReady(client);
+	}
+	client->historySeq = 0;
+	/* A message partially written is written again from the beginning on the next connection. */
+	client->outputOffset = 0;
+	while (client->outputBytes > SESSION_QUEUE_MAX) {
+		releaseOutputHead(client);
+	}
+
+	if (numDetached == DETACHED_MAX) {
+		freeClient(detachedHead);
+	}
+	client->session->detachedAt = time(NULL);
+	addToDetached(client);
+}
+
+/* Release the sessions detached for longer than SESSION_GRACE_SECONDS. */
+void expireSessions() {
+	time_t now = time(NULL);
+	while (detachedHead != NULL && now - detachedHead->session->detachedAt >= SESSION_GRACE_SECONDS) {
+		freeClient(detachedHead);
+	}
+}
+
+/* The sequence number of the last message of its channel in the output queue of a client, 0 if none. */
+unsigned long lastQueuedSeq(struct Client* client) {
+	struct Channel* channel = client->channel;
+	unsigned long last = 0;
+	if (channel == NULL) {
+		return 0;
+	}
+	for (struct OutputEntry* e = client->outputHead; e != NULL; e = e->next) {
+		unsigned long seq = e->message->seq;
+		if (seq > last && seq >= channel->firstSeq && seq <= channel->lastSeq
+				&& channel->history[seq % channel->historyCapacity] == e->message) {
+			last = seq;
+		}
+	}
+	return last;
+}
+
+/* A new connection (the client conn) presents the token of the session of client.
+ * The session takes over the connection together with the output and input conn didn't
+ * process yet, then conn is released. If the session still has a connection, because the
+ * server didn't notice yet it's broken, that connection is closed.
+ * Everything is found in constant time: no list is scanned. */
+void resumeSession(struct Client* client, struct Client* conn) {
+	if (client->detached) {
+		/* The session takes the place of conn in the chat and in fds. */
+		removeFromDetached(client);
+		client->fdsIndex = conn->fdsIndex;
+		connected[client->fdsIndex] = client;
+	} else {
+		/* The old connection is replaced by the new one, then conn leaves the chat. */
+		closeConnection(fds[client->fdsIndex].fd);
+		fds[client->fdsIndex].fd = fds[conn->fdsIndex].fd;
+		fds[client->fdsIndex].events = POLLIN;
+		fds[client->fdsIndex].revents = 0;
+		removeFromChat(conn);
+		client->outputOffset = 0;
+	}
+
+	/* What was not written to conn yet goes first, still from where it stopped. */
+	if (conn->outputHead != NULL) {
+		conn->outputTail->next = client->outputHead;
+		if (client->outputTail == NULL) {
+			client->outputTail = conn->outputTail;
+		}
+		client->outputHead = conn->outputHead;
+		client->outputOffset = conn->outputOffset;
+		client->outputBytes += conn->outputBytes;
+		/* The control messages of the session are not ahead anymore. */
+		client->controlTail = conn->controlTail;
+		client->bypassed = conn->bypassed;
+		conn->outputHead = NULL;
+		conn->outputTail = NULL;
+		conn->outputBytes = 0;
+		conn->controlTail = NULL;
+	}
+	releaseInput(client);
+	client->input = conn->input;
+	client->inputLength = conn->inputLength;
+	conn->input = NULL;
+	conn->inputLength = 0;
+	client->session->sendBuffer = conn->session->sendBuffer;
+	client->session->receiveBuffer = conn->session->receiveBuffer;
+
+	if (conn->overflowed) {
+		removeFromOverflowed(conn);
+	}
+	if (conn->ready) {
+		removeFromReady(conn);
+	}
+	deleteClientByUsername(conn->session->username);
+	deleteSessionByToken(conn->session->token);
+	removeFromChannel(conn);
+	releaseClient(conn);
+
+	reply(client, "\\session %s\n", client->session->token);
+
+	/* Whatever followed the last acknowledged message may have been lost with the old connection:
+	 * the history has all of it. */
+	if (client->acking) {
+		trimOutput(client, ULONG_MAX);
+		client->historySeq = 0;
+		sendHistory(client, client->ackedSeq);
+	} else {
+		/* The channel messages kept while detached are sent with the queue: a request for
+		 * history after the resume must not send them again. */
+		client->historySeq = lastQueuedSeq(client);
+	}
+	flushClient(client);
+}
+
+/* Run a command sent by a client, returning the client owning the connection as processLine(). */
+struct Client* processCommand(struct Client* client, char* command, char* argument) {
+	if (strcmp(command, "setusername") == 0) {
+		if (*argument == '\0' || strcmp(argument, client->session->username) == 0) {
+			return client;
+		}
+		/* If the username already exists we ignore the command,
+		 * otherwise we update the client's username in clientHashtable. */
+		if (getClientByUsername(argument) != NULL) {
+			reply(client, "Username already exists\n");
+			return client;
+		}
+		saveCursor(client);
+		deleteClientByUsername(client->session->username);
+		free(client->session->username);
+		client->session->username = strdup(argument);
+		client->session->named = 1;
+		insertClient(client->session->username, client);
+	} else if (strcmp(command, "exit") == 0) {
+		/* The user closed the connection */
+		saveCursor(client);
+		freeClient(client);
+		return NULL;
+	} else if (strcmp(command, "join") == 0) {
+		/* The user wants to join a channel. */
+		if (*argument != '\0') {
+			saveCursor(client);
+			joinChannel(client, argument);
+			if (bufferMax > 0) {
+				sizeBuffers(client);
+			}
+		}
+	} else if (strcmp(command, "history") == 0) {
+		/* The user wants the messages of the channel following a sequence number,
+		 * typically the last one seen before a reconnect. */
+		sendHistory(client, strtoul(argument, NULL, 10));
+	} else if (strcmp(command, "ack") == 0) {
+		/* The user received every message of the channel up to a sequence number. */
+		acknowledge(client, strtoul(argument, NULL, 10));
+	} else if (strcmp(command, "msg") == 0) {
+		/* A message with an id: sent again with the same id, e.g. after a reconnect, it's broadcast once. */
+		char* text = strchr(argument, ' ');
+		if (text != NULL && client->channel != NULL) {
+			*text++ = '\0';
+			if (!isDuplicate(client, argument)) {
+				broadcast(client, text);
+			}
+		}
+	} else if (strcmp(command, "unread") == 0) {
+		/* The user wants to know what it missed without downloading it. */
+		sendUnread(client);
+	} else if (strcmp(command, "top") == 0) {
+		/* The operator wants to know which clients and channels drive the load right now. The list
+		 * names the heaviest senders, so it's only answered on connections from this host. */
+		if (isLoopbackPeer(fds[client->fdsIndex].fd)) {
+			sendTop(client);
+		}
+	} else if (strcmp(command, "buffers") == 0) {
+		/* The operator wants to know how much kernel memory the socket buffers may take: like \top,
+		 * only answered on connections from this host. */
+		if (isLoopbackPeer(fds[client->fdsIndex].fd)) {
+			reply(client, "\\buffers send %ld receive %ld\n", sendBuffersTotal, receiveBuffersTotal);
+		}
+	} else if (strcmp(command, "ping") == 0) {
+		/* The user measures the round trip: the argument comes back as is. */
+		reply(client, "\\pong %s\n", argument);
+	} else if (strcmp(command, "resume") == 0) {
+		/* The user reconnected and wants its session back. */
+		struct Client* session = getClientByToken(argument);
+		if (session != NULL && session != client) {
+			resumeSession(session, client);
+			return session;
+		}
+	}
+	return client;
+}
+
+/* Handle a complete line (without '\n') sent by a client: it may be a command or a text message
+ * for the other clients. Return the client owning the connection afterwards: NULL if it has been
+ * freed, another client if the connection resumed a session. */
+struct Client* processLine(struct Client* client, char* line) {
+	if (line[0] != '\\') {
+		/* The client sent a message, broadcast the message if the client is in a channel. */
+		if (client->channel != NULL) {
+			broadcast(client, line);
+		}
+		return client;
+	}
+
+	/* Commands start with '\', the argument is the string after the first space. */
+	char* command = line + 1;
+	char* argument = strchr(command, ' ');
+	if (argument != NULL) {
+		*argument++ = '\0';
 	} else {
-		/* For any other client just update the next pointer of its previous. */
-		client->prevInChannel->nextInChannel = channelTail;
+		argument = "";
+	}
+
+	/* The command is in the caller's buffer, so it's still valid if the client is freed. */
+	PROBE1(command__start, command);
+	client = processCommand(client, command, argument);
+	PROBE1(command__done, command);
+	return client;
+}
+
+/* Whether the input buffer of a client holds a line to take, see takeLine(). */
+int hasLine(struct Client* client) {
+	return client->inputLength == INPUT_SIZE
+		|| (client->inputLength > 0 && memchr(client->input, '\n', client->inputLength) != NULL);
+}
+
+/* Take the first complete line from the input buffer of a client, without the final "\n" or "\r\n".
+ * A line filling the whole buffer is taken as if it was complete. Return 0 if there is no line. */
+int takeLine(struct Client* client, char* line) {
+	if (client->inputLength == 0) {
+		return 0;
+	}
+	char* newline = memchr(client->input, '\n', client->inputLength);
+	int length, consumed;
+	if (newline != NULL) {
+		length = newline - client->input;
+		consumed = length + 1;
+	} else if (client->inputLength == INPUT_SIZE) {
+		length = consumed = INPUT_SIZE;
+	} else {
+		return 0;
+	}
+	memcpy(line, client->input, length);
+	if (length > 0 && line[length - 1] == '\r') {
+		length--;
+	}
+	line[length] = '\0';
+	client->inputLength -= consumed;
+	if (client->inputLength == 0) {
+		releaseInput(client);
+	} else {
+		memmove(client->input, client->input + consumed, client->inputLength);
+	}
+	return 1;
+}
+
+/* Read the data sent by a client into its input buffer: the complete lines are processed when the
+ * client gets its turn in the ready queue, see serveReady(). The buffer is taken from inputPool
+ * only now, and given back if nothing was there after all. */
+void readFromClient(struct Client* client) {
+	if (client->input == NULL) {
+		client->input = poolAlloc(&inputPool);
+	}
+	int bytesRead = read(fds[client->fdsIndex].fd, client->input + client->inputLength,
+			INPUT_SIZE - client->inputLength);
+	PROBE2(read, fds[client->fdsIndex].fd, bytesRead);
+	if (bytesRead == -1 && (errno == EAGAIN || errno == EINTR)) {
+		if (client->inputLength == 0) {
+			releaseInput(client);
+		}
+		return;
 	}
-	/* We update channelTail to prevTail only if we're not deleting prevTail, otherwise tail is unchanged. */
-	if (prevTail != client) {
-		channel->tail = prevTail;
-		if (channelTail != NULL) {
-			channelTail->nextInChannel = NULL;
+	if (bytesRead <= 0) {
+		/* The client disconnected, it may come back and resume the session. */
+		detachClient(client);
+		return;
+	}
+	if (capture != NULL) {
+		captureWrite(capture, CAPTURE_DATA, fds[client->fdsIndex].fd, client->input + client->inputLength, bytesRead);
+	}
+	client->inputLength += bytesRead;
+	client->receivedBytes += bytesRead;
+	if (hasLine(client)) {
+		markReady(client);
+	}
+}
+
+/* Process up to READ_BUDGET_LINES lines of the input of a client. Lines are taken one at a time
+ * since a line may hand the connection, with the rest of the input, to another client.
+ * If some are left the client goes back to the end of the ready queue. */
+void processInput(struct Client* client) {
+	char line[INPUT_SIZE + 1];
+	for (int lines = 0; lines < READ_BUDGET_LINES; lines++) {
+		if (client == NULL || client->detached || !takeLine(client, line)) {
+			return;
 		}
+		client = processLine(client, line);
 	}
+	if (client != NULL && !client->detached && hasLine(client)) {
+		markReady(client);
+	}
+}
 
+/* Give a turn to every client in the ready queue. The ones queued again during the turns wait
+ * for the next iteration, after the clients read meanwhile. */
+void serveReady() {
+	struct Client* last = readyTail;
+	while (readyHead != NULL) {
+		struct Client* client = readyHead;
+		readyHead = client->nextReady;
+		if (readyHead == NULL) {
+			readyTail = NULL;
+		}
+		client->ready = 0;
+		/* Only the client having its turn may be freed by it. */
+		int done = client == last;
+		int fd = fds[client->fdsIndex].fd;
+		PROBE1(input__start, fd);
+		processInput(client);
+		PROBE1(input__done, fd);
+		if (done) {
+			break;
+		}
+	}
+}
+
+/* Busy polling (-b): the longest spin, in microseconds, and the current one. 0 disables it. */
+int spinMax = 0;
+int spinBudget = 0;
+
+/* Wait for events on fds like poll(). With busy polling we first spin on poll() with a zero
+ * timeout for up to spinBudget microseconds, so that events arriving shortly after the previous
+ * ones are handled without the wakeup latency of the scheduler. The budget adapts so idle periods
+ * don't burn a core: it is halved by every spin finding nothing, down to nothing at all, and
+ * doubled, up to spinMax, whenever events arrive within spinMax microseconds. */
+int waitForEvents(int timeout) {
+	/* With work already waiting (timeout 0) there is nothing to spin for: one poll() will do,
+	 * and it tells nothing about the budget. */
+	if (spinMax == 0 || timeout == 0) {
+		return poll(fds, numClients + 1, timeout);
+	}
+	long start = monotonicUs();
+	if (spinBudget > 0) {
+		long now;
+		do {
+			int numEvents = poll(fds, numClients + 1, 0);
+			if (numEvents != 0) {
+				spinBudget = spinBudget * 2 < spinMax ? spinBudget * 2 : spinMax;
+				return numEvents;
+			}
+			/* Let the other processes on this core, e.g. a local client, run meanwhile. */
+			sched_yield();
+			now = monotonicUs();
+		} while (now - start < spinBudget);
+		spinBudget = spinBudget / 2 < SPIN_MIN_US ? 0 : spinBudget / 2;
+		start = now;
+	}
+	int numEvents = poll(fds, numClients + 1, timeout);
+	if (numEvents > 0 && monotonicUs() - start < spinMax) {
+		spinBudget = spinBudget * 2 < SPIN_MIN_US ? SPIN_MIN_US : spinBudget * 2;
+		if (spinBudget > spinMax) {
+			spinBudget = spinMax;
+		}
+	}
+	return numEvents;
+}
+
+/* Set by SIGINT and SIGTERM: the server stops at the end of the current iteration. */
+volatile sig_atomic_t stopRequested = 0;
+
+void requestStop(int signal) {
+	(void) signal;
+	stopRequested = 1;
+}
+
+/* Set by SIGHUP: the patterns of the filter are loaded again before the next iteration. */
+volatile sig_atomic_t reloadRequested = 0;
+
+void requestReload(int signal) {
+	(void) signal;
+	reloadRequested = 1;
+}
+
+/* Compile the patterns of filterPath. The new filter replaces the current one between two lines,
+ * so every line is checked against one list or the other; if the file can't be read the current
+ * filter stays. */
+void reloadFilter() {
+	struct Filter* loaded = filterLoad(filterPath);
+	if (loaded == NULL) {
+		perror("Cannot load the filter patterns");
+		return;
+	}
+	filterFree(filter);
+	filter = loaded;
+}
+
+void usage() {
+	fprintf(stderr,
+		"Usage: server [-p port] [-r capture] [-j journal] [-f patterns] [-s copies] [-l connections] [-L connections] [-a rules] [-d seconds] [-F queue] [-B min:max] [-b usecs] [-c cpu] [-H] [-P clients]\n"
+		"  -p port     listen on port (default %d)\n"
+		"  -r capture  record the traffic received from clients in the capture file\n"
+		"  -j journal  keep the read cursors of the users in the journal file across restarts\n"
+		"  -f patterns don't broadcast messages containing a pattern of the file, reloaded on SIGHUP\n"
+		"  -s copies   don't broadcast a text posted more than this many times in a minute\n"
+		"  -l connections  accept up to this many connections from the same address\n"
+		"  -L connections  accept up to this many connections from the same /24 (IPv4) or /64 (IPv6)\n"
+		"  -a rules    allow, deny or limit the connections from the prefixes of the rules file\n"
+		"  -d seconds  accept connections once they send data, or after this many seconds\n"
+		"  -F queue    accept TCP Fast Open, with up to queue connections pending\n"
+		"  -B min:max  size the socket buffers of each client from its traffic, within min and max bytes\n"
+		"  -b usecs    busy poll for up to usecs microseconds before sleeping, for lower latency\n"
+		"  -c cpu      run on this CPU only, with memory from its NUMA node\n"
+		"  -H          keep clients and output queues in huge pages\n"
+		"  -P clients  allocate the memory of this many clients at startup\n",
+		DEFAULT_PORT);
+	exit(EXIT_FAILURE);
 }
 
 /* In main() first we create the server socket, then
  * we listen for connection requests and for messages from connected clients */
-int main() {
-	int serverFD = createServer(PORT);
+int main(int argc, char **argv) {
+	int port = DEFAULT_PORT;
+	char* capturePath = NULL;
+	char* journalPath = NULL;
+	char* admissionPath = NULL;
+	int perAddress = 0, perSubnet = 0;
+	int deferSeconds = 0;
+	int fastOpenQueue = 0;
+	int cpu = -1;
+	int preallocated = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:r:j:f:s:l:L:a:d:F:B:b:c:HP:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'r':
+			capturePath = optarg;
+			break;
+		case 'j':
+			journalPath = optarg;
+			break;
+		case 'f':
+			filterPath = optarg;
+			break;
+		case 's':
+			spamThreshold = atoi(optarg);
+			break;
+		case 'l':
+			perAddress = atoi(optarg);
+			break;
+		case 'L':
+			perSubnet = atoi(optarg);
+			break;
+		case 'a':
+			admissionPath = optarg;
+			break;
+		case 'd':
+			deferSeconds = atoi(optarg);
+			break;
+		case 'F':
+			fastOpenQueue = atoi(optarg);
+			break;
+		case 'B':
+			if (sscanf(optarg, "%d:%d", &bufferMin, &bufferMax) != 2 || bufferMin <= 0 || bufferMax < bufferMin) {
+				usage();
+			}
+			break;
+		case 'b':
+			spinMax = atoi(optarg);
+			spinBudget = spinMax;
+			if (spinMax < 0) {
+				usage();
+			}
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'H':
+			poolSetHugePages(1);
+			break;
+		case 'P':
+			preallocated = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
 
-	char buffer[1024];
+	/* Pin first, so that everything allocated from now on is local to the CPU. */
+	if (cpu >= 0) {
+		if (pinToCPU(cpu) == -1) {
+			perror("Cannot run on the requested CPU");
+			exit(EXIT_FAILURE);
+		}
+		poolSetNode(nodeOfCPU(cpu));
+	}
+	if (preallocated > 0) {
+		poolReserve(&clientPool, preallocated);
+		poolReserve(&sessionPool, preallocated);
+		poolReserve(&entryPool, (size_t) preallocated * PREALLOCATED_OUTPUT);
+	}
+
+	if (capturePath != NULL && (capture = captureCreate(capturePath)) == NULL) {
+		perror("Cannot create the capture");
+		exit(EXIT_FAILURE);
+	}
+	if (journalPath != NULL && cursorOpen(journalPath) == -1) {
+		perror("Cannot write the journal");
+		exit(EXIT_FAILURE);
+	}
+	if (filterPath != NULL && (filter = filterLoad(filterPath)) == NULL) {
+		perror("Cannot load the filter patterns");
+		exit(EXIT_FAILURE);
+	}
+	admission = perAddress > 0 || perSubnet > 0 || admissionPath != NULL;
+	admissionSetLimits(perAddress, perSubnet);
+	if (admissionPath != NULL && admissionLoad(admissionPath) == -1) {
+		perror("Cannot load the admission rules");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Stop cleanly, so the capture and the journal are complete. */
+	struct sigaction action = {0};
+	action.sa_handler = requestStop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	if (filterPath != NULL) {
+		action.sa_handler = requestReload;
+		sigaction(SIGHUP, &action, NULL);
+	}
+
+	int serverFD = createServer(port);
+	buffersSizedAt = time(NULL);
+	/* During a reconnection storm the clients send their burst right away: with TCP_DEFER_ACCEPT
+	 * the loop wakes up once per connection, to accept it with its first lines already there. */
+	if (deferSeconds > 0 && setDeferAccept(serverFD, deferSeconds) == -1) {
+		perror("Cannot defer accept");
+		exit(EXIT_FAILURE);
+	}
+	if (fastOpenQueue > 0 && setFastOpen(serverFD, fastOpenQueue) == -1) {
+		perror("Cannot enable TCP Fast Open");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(serverID, sizeof(serverID), "%lx%x", (unsigned long) time(NULL), (unsigned) getpid());
+	if ((randomFD = open("/dev/urandom", O_RDONLY)) == -1) {
+		perror("Cannot open /dev/urandom");
+		exit(EXIT_FAILURE);
+	}
 
 	/* At the beginning we will look for events on a single file descriptor,
 	 * that is the server looking for new connections. */
@@ -251,140 +1285,115 @@ int main() {
 		"=============================\n"
 		" Hello, Welcome in this chat \n"
 		"=============================\n";
-	int timeout = 10000;
-
-	while (1) {
-		/* We wait for events */
-		int numEvents = poll(fds, numClients + 1, timeout);
-		if (numEvents == -1) {
+	while (!stopRequested) {
+		if (reloadRequested) {
+			reloadRequested = 0;
+			reloadFilter();
+		}
+		/* We wait for events. While there are detached sessions we wake up every second to expire them,
+		 * while there are lines to process or messages to fan out we don't wait at all. */
+		int timeout = readyHead != NULL || activeHead != NULL ? 0 : detachedHead != NULL ? 1000 : 10000;
+		/* While every entry of fds is taken new connections wait in the backlog: the listening socket
+		 * is not polled, or it would stay readable and poll() would never sleep. */
+		fds[0].events = numClients < MAX_CLIENTS ? POLLIN : 0;
+		int numEvents = waitForEvents(timeout);
+		if (numEvents == -1 && errno == EINTR) {
+			continue;
+		} else if (numEvents == -1) {
 			perror("poll() error");
 			exit(EXIT_FAILURE);
 		} else if (numEvents) {
 			/* Some file descriptors reported an event */
-			if (fds[0].revents & POLLIN) {
+			if ((fds[0].revents & POLLIN) && numClients < MAX_CLIENTS) {
 			/* If the server received a connection request we append a new client
 			 * whose file descriptor will be monitored for reading */
-				int clientFD = acceptConnection(serverFD);
-
- 				/* The default value of username is set to the string "user<FD>" where <FD> is the file descriptor of that client. */
-				int usernameLength = snprintf(NULL, 0, "user%d", clientFD) + 1;
-				char *username = (char *) malloc(usernameLength);
-				snprintf(username, usernameLength, "user%d", clientFD);
-				struct Client *client = malloc(sizeof(*client));
-				client->username = username;
-				client->fdsIndex = numClients + 1;
-				fds[0].events = POLLIN;
-
-				if (chatHead == NULL) {
-					/* First client inserted. */
-					chatHead = client;
+				struct sockaddr_storage address;
+				int clientFD = acceptConnection(serverFD, &address);
+				/* Turned away before anything is allocated for the connection. */
+				if (admission && !admissionCheck(clientFD, (struct sockaddr*) &address)) {
+					PROBE1(reject, clientFD);
+					close(clientFD);
 				} else {
-					/* Append the client to chatTail. */
-					chatTail->nextInChat = client;
-					client->prevInChat = chatTail;
-				}
-				chatTail = client;
-
-				/* Update clientHashtable. */
-				insertClient(username, client);
+					setNonBlocking(clientFD);
+					/* flushAll() writes the output of an iteration at once already: Nagle's algorithm
+					 * would only hold back the messages that follow until the client acknowledges. */
+					setNoDelay(clientFD);
+					if (spinMax > 0) {
+						setBusyPoll(clientFD, spinMax);
+					}
+					PROBE1(accept, clientFD);
+					if (capture != NULL) {
+						captureWrite(capture, CAPTURE_CONNECT, clientFD, NULL, 0);
+					}
 
-				fds[client->fdsIndex].fd = clientFD;
-				fds[client->fdsIndex].events = POLLIN;
+					/* The default value of username is set to the string "user<FD>" where <FD> is the file descriptor of that client. */
+					int usernameLength = snprintf(NULL, 0, "user%d", clientFD) + 1;
+					char *username = (char *) malloc(usernameLength);
+					snprintf(username, usernameLength, "user%d", clientFD);
+					struct Client *client = allocClient();
+					client->session->username = username;
+					addToChat(client, clientFD);
 
-				numClients++;
+					/* Update clientHashtable. */
+					insertClient(username, client);
 
-				send(clientFD, welcomeMessage, strlen(welcomeMessage), 0);
+					/* Clients that track sequence numbers need to know whether the server restarted. */
+					reply(client, "\\server %s\n", serverID);
+					reply(client, "%s", welcomeMessage);
+					createSession(client);
+					/* A new client is idle until it shows otherwise: its buffers start at bufferMin. */
+					if (bufferMax > 0) {
+						sizeBuffers(client);
+					}
+				}
 			}
 
-			for (struct Client *client = chatHead; client != NULL; client = client->nextInChat) {
-				int fdsIndex = client->fdsIndex;
-
-				if (fds[fdsIndex].revents & POLLIN) {
-					/* If there is activity on a client it means:
-					 * 1. the client disconnected, or
-					 * 2. there's a message from the client */
-					int bytesRead = read(fds[fdsIndex].fd, buffer, sizeof(buffer) - 1);
-					if (bytesRead <= 0) {
-						/* The client disconnected. */
-						deleteClientByUsername(client->username);
-						freeClient(client);
-						numClients--;
-					} else {
-						/* The message may be a command or a text message for the other clients */
-						if (buffer[0] == '\\') {
-							/* Commands start with '\'. */
-							if (strncmp(buffer+1, "setusername", 11) == 0) {
-								/* The new username is the string after '\setusername ',
-								 * whose length is 13. */
-								int newUsernameLength = bytesRead - 13;
-								char* newUsername = malloc(newUsernameLength);
-								memcpy(newUsername, buffer + 13, newUsernameLength);
-								newUsername[newUsernameLength - 1] = '\0';
-
-								/* If the username already exists we ignore the command,
-								 * otherwise we update the client's username in clientHashtable. */
-								if (getClientByUsername(newUsername) != NULL) {
-									send(fds[fdsIndex].fd, "Username already exists\n", 24, 0);
-									memset(buffer, 0, sizeof buffer);
-									continue;
-								}
-								deleteClientByUsername(client->username);
-								insertClient(newUsername, client);
-								free(client->username);
-								client->username = newUsername;
-							} else if (strncmp(buffer+1, "exit", 4) == 0) {
-								/* The user closed the connection */
-								deleteClientByUsername(client->username);
-								freeClient(client);
-							} else if (strncmp(buffer+1, "join", 4) == 0) {
-								/* The user wants to join a channel, the channel's name
-								 * is the string after '\join ' whose length is 6. */
-								int length = bytesRead - 6;
-								char* name = malloc(length);
-								memcpy(name, buffer + 6, length);
-								name[length - 1] = '\0';
-
-								/* Create the channel if it doesn't exist. */
-								struct Channel* channel;
-								if ((channel = getChannelByName(name)) == NULL) {
-									channel = malloc(sizeof(channel));
-									channel->name = name;
-									insertChannel(name, channel);
-								}
-
-								/* Update the channel state appending the current client. */
-								client->channel = channel;
-								if (channel->head == NULL) {
-									channel->head = client;
-								} else {
-									channel->tail->nextInChannel = client;
-									client->prevInChannel = channel->tail;
-								}
-								channel->tail = client;
-							}
-						} else {
-							/* The client sent a message, broadcast the message */
-							if (client->channel == NULL) {
-								/* Ignore the message if the client is in none channel. */
-								continue;
-							}
-
-							/* Otherwise broadcast the message in that channel. */
-							char message[1024];
-							int messageLength = snprintf(message, sizeof(message), "%s> %s", client->username, buffer);
-
-							for (struct Client *c = client->channel->head; c != NULL; c = c->nextInChannel) {
-								if (c != client) {
-									send(fds[c->fdsIndex].fd, message, messageLength, 0);
-								}
-							}
-						}
-					}
-					memset(buffer, 0, sizeof buffer);
+			/* removeFromChat() moves the last client in place of the removed one: scanning from the
+			 * last entry down, the one moved has been handled already. */
+			for (int i = numClients; i > 0; i--) {
+				struct Client* client = connected[i];
+
+				/* If there is activity on a client it means:
+				 * 1. the client disconnected, or
+				 * 2. there's data from the client, read once the lines read before are processed, or
+				 * 3. there's room to write the output queued for the client */
+				int revents = fds[i].revents;
+				if (revents & POLLOUT) {
+					flushClient(client);
 				}
+				if ((revents & (POLLIN | POLLHUP | POLLERR)) && !client->ready) {
+					readFromClient(client);
+				}
+			}
+		}
+
+		serveReady();
+		fanOut();
+
+		/* The clients that don't keep up with their output lose the connection, not the session. */
+		while (overflowedHead != NULL) {
+			struct Client* client = overflowedHead;
+			overflowedHead = client->nextOverflowed;
+			client->overflowed = 0;
+			if (!client->detached) {
+				detachClient(client);
 			}
 		}
+		flushAll();
+		expireSessions();
+		if (bufferMax > 0) {
+			sizeAllBuffers();
+		}
+		trimDirtyChannels();
+		cursorFlush();
 	}
 
+	if (capture != NULL) {
+		fclose(capture);
+	}
+	for (int i = 1; i <= numClients; i++) {
+		saveCursor(connected[i]);
+	}
+	cursorClose();
 	return 0;
 }
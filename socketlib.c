@@ -17,9 +17,15 @@
  */
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+/* Linux socket options hidden by _XOPEN_SOURCE, like SO_BUSY_POLL. */
+#include <asm/socket.h>
 
 /* To create the server we instantiate a socket relying on:
  * 1. socket() to create a socket that allows communication between processes on different hosts connected by IPV4
@@ -52,7 +58,8 @@ int createServer(int port) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(serverFD, 3) == -1) {
+	/* A long backlog absorbs bursts of connections, e.g. clients reconnecting after a restart. */
+	if (listen(serverFD, SOMAXCONN) == -1) {
 		perror("listen error");
 		exit(EXIT_FAILURE);
 	}
@@ -60,13 +67,14 @@ int createServer(int port) {
 	return serverFD;
 }
 
-/* Create a socket from a client connection request and return the relative file descriptor. 
- * Retry in case of error. */
-int acceptConnection(int serverFD) {
-	struct sockaddr_in address;
-	socklen_t addrlen = sizeof(address);
+/* Create a socket from a client connection request and return the relative file descriptor,
+ * storing the address of the peer in address. Retry in case of error. */
+int acceptConnection(int serverFD, struct sockaddr_storage *address) {
+	socklen_t addrlen = sizeof(*address);
 	int clientFD;
-	while ((clientFD = accept(serverFD, (struct sockaddr*) &address, &addrlen)) == -1);
+	while ((clientFD = accept(serverFD, (struct sockaddr*) address, &addrlen)) == -1) {
+		addrlen = sizeof(*address);
+	}
 	return clientFD;
 }
 
@@ -101,3 +109,101 @@ void connectToServer(int clientFD, char *ip, int port) {
 		exit(EXIT_FAILURE);
 	}
 }
+
+/* Put a socket in non-blocking mode: reads and writes that cannot proceed fail with EAGAIN
+ * instead of waiting. Return -1 on failure. */
+int setNonBlocking(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Ask the kernel to busy poll the device queue for up to usecs microseconds when a read on
+ * the socket finds no data, instead of sleeping until the interrupt. It only matters for devices
+ * supporting it (not loopback), and values above net.core.busy_read require CAP_NET_ADMIN. */
+int setBusyPoll(int fd, int usecs) {
+	return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+}
+
+/* Disable Nagle's algorithm: small writes are sent right away instead of waiting for the
+ * acknowledgement of the data in flight, which the peer may delay by tens of milliseconds. */
+int setNoDelay(int fd) {
+	int enable = 1;
+	return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+/* Wake up the listener only when a connection has sent data, for up to seconds after the handshake:
+ * connections that don't send anything in the meantime are accepted later, when the kernel
+ * retransmits the SYN-ACK and the peer answers. */
+int setDeferAccept(int fd, int seconds) {
+	return setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+}
+
+/* Accept TCP Fast Open on a listener: a client holding a cookie from an earlier connection sends
+ * its first data with the SYN, and the connection can be accepted and read right away. queue bounds
+ * the connections pending like that. The server side has to be enabled in net.ipv4.tcp_fastopen (2). */
+int setFastOpen(int fd, int queue) {
+	return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue));
+}
+
+/* Use TCP Fast Open on a client socket, before connecting: connect() returns right away and the SYN
+ * leaves with the first write, carrying it when the server gave a cookie before. Without a cookie
+ * a non-blocking write fails with EINPROGRESS, and the socket becomes writable once connected. */
+int setFastOpenConnect(int fd) {
+	int enable = 1;
+	return setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(enable));
+}
+
+/* Like createClient() but the socket is non-blocking.
+ * Errors are reported to the caller instead of terminating the process, since this is
+ * meant to be used by long running programs handling many connections. They batch their
+ * writes on their own, so Nagle's algorithm would only add latency. */
+int createNonBlockingClient() {
+	int clientFD;
+	if ((clientFD = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+	if (setNonBlocking(clientFD) == -1 || setNoDelay(clientFD) == -1) {
+		close(clientFD);
+		return -1;
+	}
+	return clientFD;
+}
+
+/* Initiate the connection of a non-blocking client socket to the server.
+ * Return 0 if the connection is already established, 1 if it is in progress (the socket
+ * becomes writable once it completes) and -1 on failure. */
+int startConnection(int clientFD, char *ip, int port) {
+	struct sockaddr_in serverAddress;
+
+	serverAddress.sin_family = AF_INET;
+	serverAddress.sin_port = htons(port);
+
+	if (inet_pton(AF_INET, ip, &serverAddress.sin_addr) <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (connect(clientFD, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) == 0) {
+		return 0;
+	}
+	return errno == EINPROGRESS ? 1 : -1;
+}
+
+/* Whether the peer of a connected socket is on this host: 127.0.0.0/8 or ::1. */
+int isLoopbackPeer(int fd) {
+	struct sockaddr_storage address;
+	socklen_t length = sizeof(address);
+	if (getpeername(fd, (struct sockaddr*) &address, &length) == -1) {
+		return 0;
+	}
+	if (address.ss_family == AF_INET) {
+		return ntohl(((struct sockaddr_in*) &address)->sin_addr.s_addr) >> 24 == 127;
+	}
+	if (address.ss_family == AF_INET6) {
+		return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6*) &address)->sin6_addr);
+	}
+	return 0;
+}
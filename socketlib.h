@@ -1,8 +1,27 @@
+#include <sys/socket.h>
+
 int createServer(int port);
 
-int acceptConnection(int serverFD);
+int acceptConnection(int serverFD, struct sockaddr_storage *address);
 
 int createClient();
 
 void connectToServer(int clientFD, char *ip, int port);
 
+int createNonBlockingClient();
+
+int startConnection(int clientFD, char *ip, int port);
+
+int setNonBlocking(int fd);
+
+int setBusyPoll(int fd, int usecs);
+
+int setNoDelay(int fd);
+
+int setDeferAccept(int fd, int seconds);
+
+int setFastOpen(int fd, int queue);
+
+int setFastOpenConnect(int fd);
+
+int isLoopbackPeer(int fd);
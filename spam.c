@@ -0,0 +1,95 @@
+/*
+ * spam.c - duplicate spam detection
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <string.h>
+
+#include "spam.h"
+
+/* Texts with fewer letters than this are not fingerprinted: "ok" or "thanks" are repeated
+ * all the time without being spam. */
+#define SPAM_MIN_LETTERS 16
+/* The sketch: SKETCH_DEPTH rows of SKETCH_WIDTH counters, a power of two. */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 4096
+
+/* The window is split in two halves with a sketch each: counts are the sum of both, and when
+ * a half is over the older sketch is cleared and becomes the current one. */
+static unsigned int sketches[2][SKETCH_DEPTH][SKETCH_WIDTH];
+static int current;
+static time_t halfEnd;
+
+/* The fingerprint of a text: a 64-bit FNV-1a hash of its letters in lower case, with every run
+ * of other characters counted as a single space. 0 if the text is too short to tell. */
+unsigned long spamFingerprint(char *text) {
+	unsigned long h = 14695981039346656037UL;
+	int letters = 0;
+	int separator = 0;
+	for (unsigned char *c = (unsigned char *) text; *c != '\0'; c++) {
+		if (!isalpha(*c)) {
+			separator = letters > 0;
+			continue;
+		}
+		if (separator) {
+			h = (h ^ ' ') * 1099511628211UL;
+			separator = 0;
+		}
+		h = (h ^ tolower(*c)) * 1099511628211UL;
+		letters++;
+	}
+	if (letters < SPAM_MIN_LETTERS) {
+		return 0;
+	}
+	return h == 0 ? 1 : h;
+}
+
+/* Count one more occurrence of a fingerprint at time now and return its occurrences in the
+ * window, this one included. Counters are incremented conservatively: in every row only if they
+ * don't exceed the estimate already, which keeps the overestimation of the other texts low. */
+int spamCount(unsigned long fingerprint, time_t now) {
+	if (now >= halfEnd) {
+		int older = 1 - current;
+		if (now >= halfEnd + SPAM_WINDOW / 2) {
+			/* Nothing was counted for a whole window. */
+			memset(sketches[current], 0, sizeof(sketches[current]));
+		}
+		memset(sketches[older], 0, sizeof(sketches[older]));
+		current = older;
+		halfEnd = now + SPAM_WINDOW / 2;
+	}
+
+	/* The rows hash with different halves and rotations of the fingerprint, mixed again. */
+	unsigned int *counters[2][SKETCH_DEPTH];
+	unsigned int estimate = ~0u;
+	for (int r = 0; r < SKETCH_DEPTH; r++) {
+		unsigned long mixed = (fingerprint ^ (fingerprint >> (17 + 7 * r))) * (0x9e3779b97f4a7c15UL + 2 * r);
+		int column = (mixed >> 32) & (SKETCH_WIDTH - 1);
+		counters[0][r] = &sketches[current][r][column];
+		counters[1][r] = &sketches[1 - current][r][column];
+		unsigned int count = *counters[0][r] + *counters[1][r];
+		if (count < estimate) {
+			estimate = count;
+		}
+	}
+	for (int r = 0; r < SKETCH_DEPTH; r++) {
+		if (*counters[0][r] + *counters[1][r] == estimate) {
+			(*counters[0][r])++;
+		}
+	}
+	return estimate + 1;
+}
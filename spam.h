@@ -0,0 +1,12 @@
+/* Duplicate spam detection: counts how many times a text was seen recently, across every channel.
+ * Texts are compared by a fingerprint of their normalized form, so that copies differing in case,
+ * punctuation, spacing or numbers count as the same. The counts come from a count-min sketch of
+ * fixed size covering the last SPAM_WINDOW seconds: they may be overestimated, never underestimated. */
+
+#include <time.h>
+
+#define SPAM_WINDOW 60
+
+unsigned long spamFingerprint(char *text);
+
+int spamCount(unsigned long fingerprint, time_t now);
@@ -0,0 +1,118 @@
+/*
+ * spawn.c - start the server under test for the benchmarks
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "socketlib.h"
+#include "spawn.h"
+
+/* CPU time used by a process, in seconds. */
+double processCPU(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+	FILE *stat = fopen(path, "r");
+	if (stat == NULL) {
+		return 0;
+	}
+	unsigned long utime = 0, stime = 0;
+	/* Fields 14 and 15 are user and system time in clock ticks. The command name in field 2
+	 * may contain spaces, so we start after its closing parenthesis. */
+	char line[1024];
+	if (fgets(line, sizeof(line), stat) != NULL) {
+		char *p = strrchr(line, ')');
+		if (p != NULL) {
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+		}
+	}
+	fclose(stat);
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/* Memory of a process resident in RAM, in bytes. */
+long processMemory(pid_t pid) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/statm", (int) pid);
+	FILE *statm = fopen(path, "r");
+	if (statm == NULL) {
+		return 0;
+	}
+	long pages = 0;
+	if (fscanf(statm, "%*s %ld", &pages) != 1) {
+		pages = 0;
+	}
+	fclose(statm);
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Start the server under test on port, with further options separated by spaces if not NULL,
+ * and wait until it accepts connections. */
+pid_t startServer(char *path, int port, char *options) {
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork error");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		char portArgument[16];
+		snprintf(portArgument, sizeof(portArgument), "%d", port);
+		char *arguments[64] = { path, "-p", portArgument };
+		int numArguments = 3;
+		if (options != NULL) {
+			for (char *option = strtok(options, " "); option != NULL && numArguments < 63; option = strtok(NULL, " ")) {
+				arguments[numArguments++] = option;
+			}
+		}
+		arguments[numArguments] = NULL;
+		execv(path, arguments);
+		perror("Cannot start the server");
+		_exit(EXIT_FAILURE);
+	}
+
+	struct timespec delay = { 0, 50000000 };
+	for (int attempt = 0; attempt < 100; attempt++) {
+		nanosleep(&delay, NULL);
+		int fd = createNonBlockingClient();
+		if (startConnection(fd, "127.0.0.1", port) != -1) {
+			struct pollfd pfd = { fd, POLLOUT, 0 };
+			int error = 0;
+			socklen_t length = sizeof(error);
+			if (poll(&pfd, 1, 1000) == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+				close(fd);
+				return pid;
+			}
+		}
+		close(fd);
+	}
+	fprintf(stderr, "The server didn't start\n");
+	kill(pid, SIGTERM);
+	exit(EXIT_FAILURE);
+}
+
+/* Stop a server started by startServer() and wait for it to exit. */
+void stopServer(pid_t pid) {
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
@@ -0,0 +1,11 @@
+/* The benchmarks (replay, loadgen) run the server under test as a child process. */
+
+#include <sys/types.h>
+
+double processCPU(pid_t pid);
+
+long processMemory(pid_t pid);
+
+pid_t startServer(char *path, int port, char *options);
+
+void stopServer(pid_t pid);
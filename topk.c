@@ -0,0 +1,89 @@
+/*
+ * topk.c - heavy hitters with Space-Saving
+ * Copyright (C) 2023 Antonio Addeo <antaddnf@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "topk.h"
+
+/* Halve the counts once for every half life elapsed since the last time. */
+static void decay(struct TopK *topk, time_t now) {
+	if (topk->decayAt == 0) {
+		topk->decayAt = now + TOPK_HALF_LIFE;
+	}
+	while (now >= topk->decayAt && topk->numEntries > 0) {
+		for (int i = 0; i < topk->numEntries; i++) {
+			topk->entries[i].count /= 2;
+			topk->entries[i].error /= 2;
+		}
+		topk->decayAt += TOPK_HALF_LIFE;
+	}
+	if (now >= topk->decayAt) {
+		topk->decayAt = now + TOPK_HALF_LIFE;
+	}
+}
+
+/* Add weight to the count of a key. With TOPK_SIZE entries the scans are cheaper than a heap. */
+void topkAdd(struct TopK *topk, char *key, unsigned long weight, time_t now) {
+	decay(topk, now);
+	int smallest = 0;
+	for (int i = 0; i < topk->numEntries; i++) {
+		struct TopKEntry *entry = &topk->entries[i];
+		if (strncmp(entry->key, key, TOPK_KEY - 1) == 0) {
+			entry->count += weight;
+			return;
+		}
+		if (entry->count < topk->entries[smallest].count) {
+			smallest = i;
+		}
+	}
+	struct TopKEntry *entry;
+	if (topk->numEntries < TOPK_SIZE) {
+		entry = &topk->entries[topk->numEntries++];
+		entry->count = 0;
+	} else {
+		entry = &topk->entries[smallest];
+	}
+	entry->error = entry->count;
+	entry->count += weight;
+	strncpy(entry->key, key, TOPK_KEY - 1);
+	entry->key[TOPK_KEY - 1] = '\0';
+}
+
+/* Fill entries with the largest max entries, largest first. Return how many. */
+int topkList(struct TopK *topk, struct TopKEntry **entries, int max, time_t now) {
+	decay(topk, now);
+	int count = 0;
+	for (int i = 0; i < topk->numEntries; i++) {
+		struct TopKEntry *entry = &topk->entries[i];
+		if (entry->count == 0) {
+			continue;
+		}
+		/* Insertion sort, keeping the first max. */
+		int j = count < max ? count++ : max;
+		while (j > 0 && entries[j - 1]->count < entry->count) {
+			if (j < max) {
+				entries[j] = entries[j - 1];
+			}
+			j--;
+		}
+		if (j < max) {
+			entries[j] = entry;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,29 @@
+/* Heavy hitters: the keys with the largest total weight in a stream, e.g. the clients sending the
+ * most bytes, tracked with the Space-Saving algorithm in constant memory. Only TOPK_SIZE keys are
+ * counted: a new key takes the place of the smallest one and inherits its count, which is then its
+ * maximum overestimation (error). Every key whose true weight exceeds 1/TOPK_SIZE of the total is
+ * guaranteed to be there. Counts halve every TOPK_HALF_LIFE seconds, so they follow the current load. */
+
+#include <time.h>
+
+#define TOPK_SIZE 32
+/* Keys longer than this are cut. */
+#define TOPK_KEY 48
+#define TOPK_HALF_LIFE 60
+
+struct TopKEntry {
+	char key[TOPK_KEY];
+	unsigned long count;
+	unsigned long error;
+};
+
+struct TopK {
+	char *name;
+	int numEntries;
+	struct TopKEntry entries[TOPK_SIZE];
+	time_t decayAt;
+};
+
+void topkAdd(struct TopK *topk, char *key, unsigned long weight, time_t now);
+
+int topkList(struct TopK *topk, struct TopKEntry **entries, int max, time_t now);